@@ -0,0 +1,85 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace {
+
+thread_local Arena *currentArena = nullptr;
+
+}
+
+Arena::Arena(size_t blockSize) : blockSize(blockSize) {}
+
+Arena::~Arena() {
+    for(auto& block : blocks) {
+        ::operator delete(block.data);
+    }
+}
+
+void Arena::add_block(size_t minimumSize) {
+    Block block;
+    block.size = std::max(blockSize, minimumSize);
+    block.data = static_cast<char *>(::operator new(block.size));
+    blocks.push_back(block);
+
+    cursor = block.data;
+    end = block.data + block.size;
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+    auto aligned = [alignment](char *pointer) {
+        auto address = reinterpret_cast<uintptr_t>(pointer);
+        return reinterpret_cast<char *>((address + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1));
+    };
+
+    auto start = cursor ? aligned(cursor) : nullptr;
+    if(!start || start + size > end) {
+        add_block(size + alignment);
+        start = aligned(cursor);
+    }
+
+    cursor = start + size;
+    return start;
+}
+
+bool Arena::owns(const void *pointer) const {
+    auto p = static_cast<const char *>(pointer);
+    for(auto& block : blocks) {
+        if(p >= block.data && p < block.data + block.size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Arena::reset() {
+    if(blocks.empty()) {
+        return;
+    }
+
+    // keep the largest block we needed, so the next round fits in one
+    auto largest = std::max_element(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) {
+        return a.size < b.size;
+    });
+    std::swap(*largest, blocks.front());
+    for(size_t i = 1; i < blocks.size(); i++) {
+        ::operator delete(blocks[i].data);
+    }
+    blocks.resize(1);
+
+    cursor = blocks[0].data;
+    end = blocks[0].data + blocks[0].size;
+}
+
+Arena *current_arena() {
+    return currentArena;
+}
+
+ArenaScope::ArenaScope(Arena& arena) : previous(currentArena) {
+    currentArena = &arena;
+}
+
+ArenaScope::~ArenaScope() {
+    currentArena = previous;
+}
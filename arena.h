@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Bump allocator: allocation is a pointer increment, individual frees do
+// nothing, and everything is released at once by reset().
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 64 * 1024);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void *allocate(size_t size, size_t alignment);
+    bool owns(const void *pointer) const;
+
+    // Releases everything allocated so far. The largest block is kept, so an
+    // arena that is reset regularly stops touching the heap altogether.
+    void reset();
+
+private:
+    struct Block {
+        char *data;
+        size_t size;
+    };
+
+    void add_block(size_t minimumSize);
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    char *cursor = nullptr;
+    char *end = nullptr;
+};
+
+// The calling thread's current arena, or nullptr.
+Arena *current_arena();
+
+// Makes arena the calling thread's current arena while it is alive.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena& arena);
+    ~ArenaScope();
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    Arena *previous;
+};
+
+// Standard allocator over the current arena, falling back to the heap when
+// there is none. Containers using it must be destroyed inside the same
+// ArenaScope they were filled in.
+template<typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator() = default;
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T *allocate(size_t n) {
+        if(auto arena = current_arena()) {
+            return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *pointer, size_t) {
+        auto arena = current_arena();
+        if(arena && arena->owns(pointer)) {
+            return;
+        }
+        ::operator delete(pointer);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&) {
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&) {
+    return false;
+}
@@ -0,0 +1,548 @@
+// Throughput benchmark: generates a synthetic C or C++ corpus, runs the
+// clangtags binary over it once per output format and reports cursors/s,
+// output bytes/s and peak RSS for each format.
+//
+//   clangtags_bench [options] [-- clangtags options]
+//
+// Everything after "--" is passed to clangtags ahead of the corpus, so the
+// same corpus can be measured with e.g. --declarations or --engine index.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+struct CorpusOptions {
+    unsigned files = 100;
+    // per source file, and per header
+    unsigned decls = 200;
+    // length of the header chain every source file includes
+    unsigned includeDepth = 4;
+    // share of C++ declarations that are templates, 0 to 1
+    double templateDensity = 0.2;
+    bool cxx = true;
+};
+
+struct BenchOptions {
+    CorpusOptions corpus;
+    // generated into a temporary directory, and removed again, when empty
+    std::string corpusDirectory;
+    bool keepCorpus = false;
+    std::string clangtags;
+    std::vector<std::string> formats = { "json", "ndjson", "cbor", "msgpack", "ubjson", "bson" };
+    unsigned jobs = 0;
+    unsigned runs = 1;
+    bool json = false;
+    std::vector<std::string> clangtagsArgs;
+};
+
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    std::istringstream in(list);
+    std::string item;
+    while(std::getline(in, item, ',')) {
+        if(!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// The clangtags binary built along with this one, or else the one next to
+// it, or else whichever is on PATH.
+std::string default_clangtags() {
+#ifdef CLANGTAGS_PATH
+    return CLANGTAGS_PATH;
+#else
+    char path[PATH_MAX];
+    auto length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if(length <= 0) {
+        return "clangtags";
+    }
+
+    std::string self(path, static_cast<size_t>(length));
+    auto slash = self.rfind('/');
+    return self.substr(0, slash + 1) + "clangtags";
+#endif
+}
+
+BenchOptions parse_options(int argc, char *argv[]) {
+    BenchOptions options;
+
+    int i = 1;
+    for(; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if(arg == "--") {
+            i++;
+            break;
+        }
+        else if(arg == "--files" && i + 1 < argc) {
+            options.corpus.files = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if(arg == "--decls" && i + 1 < argc) {
+            options.corpus.decls = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if(arg == "--include-depth" && i + 1 < argc) {
+            options.corpus.includeDepth = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if(arg == "--template-density" && i + 1 < argc) {
+            options.corpus.templateDensity = std::stod(argv[++i]);
+        }
+        else if(arg == "--language" && i + 1 < argc) {
+            std::string language(argv[++i]);
+            if(language != "c" && language != "c++") {
+                throw std::runtime_error("unknown language: " + language);
+            }
+            options.corpus.cxx = language == "c++";
+        }
+        else if(arg == "--corpus" && i + 1 < argc) {
+            options.corpusDirectory = argv[++i];
+        }
+        else if(arg == "--keep-corpus") {
+            options.keepCorpus = true;
+        }
+        else if(arg == "--clangtags" && i + 1 < argc) {
+            options.clangtags = argv[++i];
+        }
+        else if(arg == "--formats" && i + 1 < argc) {
+            options.formats = split_list(argv[++i]);
+        }
+        else if((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            options.jobs = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if(arg == "--runs" && i + 1 < argc) {
+            options.runs = std::max(1u, static_cast<unsigned>(std::stoul(argv[++i])));
+        }
+        else if(arg == "--json") {
+            options.json = true;
+        }
+        else {
+            throw std::runtime_error("unknown option: " + arg);
+        }
+    }
+
+    options.clangtagsArgs.assign(argv + i, argv + argc);
+
+    if(options.clangtags.empty()) {
+        options.clangtags = default_clangtags();
+    }
+
+    return options;
+}
+
+// Writes a deterministic mix of structs, functions with bodies, variables,
+// enums and typedefs, and with cxx some share of templates. Everything is
+// named after prefix so files never clash. In headers, functions are static
+// inline so every TU can define them.
+std::string generate_declarations(const std::string& prefix, const CorpusOptions& options, bool header,
+                                  const std::string& callee) {
+    std::ostringstream out;
+    double templateCredit = 0;
+
+    for(unsigned i = 0; i < options.decls; i++) {
+        auto name = prefix + "_" + std::to_string(i);
+
+        // the first few declarations, which other files refer to, and the
+        // structs, which typedefs refer to, are always plain
+        if(options.cxx && i >= 5 && i % 5 != 0) {
+            templateCredit += options.templateDensity;
+            if(templateCredit >= 1) {
+                templateCredit -= 1;
+                if(i % 2 == 0) {
+                    out << "template<typename T>\n"
+                        << "struct box" << name << " {\n"
+                        << "    T value;\n"
+                        << "    T get() const { return value + T(" << i << "); }\n"
+                        << "};\n"
+                        << "static box" << name << "<int> use" << name << "{ " << i << " };\n\n";
+                }
+                else {
+                    out << "template<typename T>\n"
+                        << "T tmpl" << name << "(T x) {\n"
+                        << "    return x * T(" << i << ");\n"
+                        << "}\n"
+                        << "static int use" << name << " = tmpl" << name << "<int>(" << i << ");\n\n";
+                }
+                continue;
+            }
+        }
+
+        switch(i % 5) {
+            case 0:
+                out << "struct s" << name << " {\n"
+                    << "    int a;\n"
+                    << "    double b;\n"
+                    << "    struct s" << name << " *next;\n";
+                if(options.cxx) {
+                    out << "    int sum() const { return a + static_cast<int>(b); }\n";
+                }
+                out << "};\n\n";
+                break;
+            case 1:
+                out << (header ? "static inline " : "") << "int fn" << name << "(int x) {\n"
+                    << "    int y = x * " << i << ";\n"
+                    << "    for(int k = 0; k < x; k++) {\n"
+                    << "        y += " << (callee.empty() ? "k" : callee + "(k)") << ";\n"
+                    << "    }\n"
+                    << "    return y;\n"
+                    << "}\n\n";
+                break;
+            case 2:
+                out << "static int v" << name << " = " << i << ";\n\n";
+                break;
+            case 3:
+                out << "enum e" << name << " { a" << name << ", b" << name << " = " << i << " };\n\n";
+                break;
+            default:
+                // i - 4 is always a struct
+                out << "typedef struct s" << prefix << "_" << (i - 4) << " t" << name << ";\n\n";
+                break;
+        }
+    }
+
+    return out.str();
+}
+
+void write_file(const std::string& path, const std::string& contents) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << contents;
+    if(!out) {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+void make_directory(const std::string& path) {
+    if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw std::runtime_error("failed to create " + path);
+    }
+}
+
+// Lays out directory/include/h<k>, each including the next, and
+// directory/src/f<n>, each including the first header. Returns the batch
+// file listing the sources; created receives every path written.
+std::string generate_corpus(const std::string& directory, const CorpusOptions& options,
+                            std::vector<std::string>& created) {
+    auto headerExtension = options.cxx ? ".hpp" : ".h";
+    auto sourceExtension = options.cxx ? ".cpp" : ".c";
+
+    make_directory(directory + "/include");
+    make_directory(directory + "/src");
+
+    // the first function of a header, for sources and other headers to call
+    auto header_function = [&options](unsigned depth) {
+        return options.decls > 1 ? "fnh" + std::to_string(depth) + "_1" : std::string();
+    };
+
+    for(unsigned depth = 0; depth < options.includeDepth; depth++) {
+        std::string contents = "#pragma once\n\n";
+        std::string callee;
+        if(depth + 1 < options.includeDepth) {
+            contents += "#include \"h" + std::to_string(depth + 1) + headerExtension + "\"\n\n";
+            callee = header_function(depth + 1);
+        }
+        contents += generate_declarations("h" + std::to_string(depth), options, true, callee);
+
+        auto path = directory + "/include/h" + std::to_string(depth) + headerExtension;
+        write_file(path, contents);
+        created.push_back(path);
+    }
+
+    std::string batch;
+    for(unsigned file = 0; file < options.files; file++) {
+        std::string contents;
+        std::string callee;
+        if(options.includeDepth > 0) {
+            contents += std::string("#include \"h0") + headerExtension + "\"\n\n";
+            callee = header_function(0);
+        }
+
+        auto prefix = "f" + std::to_string(file);
+        if(options.cxx) {
+            contents += "namespace " + prefix + " {\n\n";
+        }
+        contents += generate_declarations(prefix, options, false, callee);
+        if(options.cxx) {
+            contents += "}\n";
+        }
+
+        auto path = directory + "/src/" + prefix + sourceExtension;
+        write_file(path, contents);
+        created.push_back(path);
+        batch += path + "\n";
+    }
+
+    auto batchPath = directory + "/files.txt";
+    write_file(batchPath, batch);
+    created.push_back(batchPath);
+
+    return batchPath;
+}
+
+void remove_corpus(const std::string& directory, const std::vector<std::string>& created) {
+    for(auto& path : created) {
+        std::remove(path.c_str());
+    }
+    rmdir((directory + "/include").c_str());
+    rmdir((directory + "/src").c_str());
+    rmdir(directory.c_str());
+}
+
+struct RunResult {
+    double seconds = 0;
+    uint64_t bytes = 0;
+    // only counted for ndjson, where every record is a line
+    uint64_t cursors = 0;
+    long peakRssKb = 0;
+    int status = 0;
+};
+
+// Counts the records in ndjson output fed to it in arbitrary pieces. Lines
+// defining --intern strings are not records.
+class LineCounter {
+public:
+    void feed(const char *data, size_t size) {
+        static const char stringPrefix[] = "{\"string\":";
+        static const size_t prefixLength = sizeof(stringPrefix) - 1;
+
+        for(size_t i = 0; i < size; i++) {
+            if(data[i] == '\n') {
+                if(matched < prefixLength) {
+                    lines++;
+                }
+                matched = 0;
+                mismatched = false;
+            }
+            else if(!mismatched && matched < prefixLength) {
+                if(data[i] == stringPrefix[matched]) {
+                    matched++;
+                }
+                else {
+                    mismatched = true;
+                }
+            }
+        }
+    }
+
+    uint64_t lines = 0;
+
+private:
+    // how much of the current line matched the prefix so far
+    size_t matched = 0;
+    bool mismatched = false;
+};
+
+RunResult run_clangtags(const std::vector<std::string>& args, bool countLines) {
+    int fds[2];
+    if(pipe(fds) != 0) {
+        throw std::runtime_error("pipe failed");
+    }
+
+    std::vector<char *> argv;
+    for(auto& arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto pid = fork();
+    if(pid < 0) {
+        throw std::runtime_error("fork failed");
+    }
+    if(pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        // a bare name is looked up on PATH
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(fds[1]);
+
+    RunResult result;
+    LineCounter counter;
+    char buffer[64 * 1024];
+    for(;;) {
+        auto n = read(fds[0], buffer, sizeof(buffer));
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        result.bytes += static_cast<uint64_t>(n);
+        if(countLines) {
+            counter.feed(buffer, static_cast<size_t>(n));
+        }
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    while(wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.cursors = counter.lines;
+    // kilobytes on Linux
+    result.peakRssKb = usage.ru_maxrss;
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return result;
+}
+
+std::vector<std::string> clangtags_command(const BenchOptions& options, const std::string& format,
+                                           const std::string& batch, const std::string& directory) {
+    std::vector<std::string> args = { options.clangtags, "--format", format, "--batch", batch };
+    if(options.jobs) {
+        args.push_back("--jobs");
+        args.push_back(std::to_string(options.jobs));
+    }
+    args.insert(args.end(), options.clangtagsArgs.begin(), options.clangtagsArgs.end());
+
+    args.push_back("--");
+    args.push_back("-I" + directory + "/include");
+    if(options.corpus.cxx) {
+        args.push_back("-std=c++11");
+    }
+    return args;
+}
+
+// Keeps the fastest of runs, and the highest peak RSS.
+RunResult best_of(const BenchOptions& options, const std::vector<std::string>& args, bool countLines) {
+    RunResult best;
+    for(unsigned run = 0; run < options.runs; run++) {
+        auto result = run_clangtags(args, countLines);
+        if(result.status != 0) {
+            return result;
+        }
+
+        auto peak = std::max(best.peakRssKb, result.peakRssKb);
+        if(run == 0 || result.seconds < best.seconds) {
+            best = result;
+        }
+        best.peakRssKb = peak;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    auto options = parse_options(argc, argv);
+
+    auto directory = options.corpusDirectory;
+    bool temporary = directory.empty();
+    if(temporary) {
+        char pattern[] = "/tmp/clangtags_bench.XXXXXX";
+        if(!mkdtemp(pattern)) {
+            throw std::runtime_error("failed to create a temporary directory");
+        }
+        directory = pattern;
+    }
+    else {
+        make_directory(directory);
+    }
+
+    std::vector<std::string> created;
+    auto batch = generate_corpus(directory, options.corpus, created);
+
+    uint64_t corpusBytes = 0;
+    for(auto& path : created) {
+        struct stat st;
+        if(stat(path.c_str(), &st) == 0) {
+            corpusBytes += static_cast<uint64_t>(st.st_size);
+        }
+    }
+
+    // cursors are counted once from ndjson, which has one line per record
+    auto count = best_of(options, clangtags_command(options, "ndjson", batch, directory), true);
+    if(count.status != 0) {
+        std::cerr << "clangtags failed with status " << count.status << std::endl;
+        if(temporary && !options.keepCorpus) {
+            remove_corpus(directory, created);
+        }
+        return 1;
+    }
+    auto cursors = count.cursors;
+
+    json results = json::array();
+    int status = 0;
+    for(auto& format : options.formats) {
+        auto result = format == "ndjson" ? count : best_of(options, clangtags_command(options, format, batch, directory), false);
+        if(result.status != 0) {
+            std::cerr << format << ": clangtags failed with status " << result.status << std::endl;
+            status = 1;
+            continue;
+        }
+
+        json entry;
+        entry["format"] = format;
+        entry["seconds"] = result.seconds;
+        entry["cursors"] = cursors;
+        entry["bytes"] = result.bytes;
+        entry["cursors_per_second"] = result.seconds > 0 ? cursors / result.seconds : 0.0;
+        entry["bytes_per_second"] = result.seconds > 0 ? result.bytes / result.seconds : 0.0;
+        entry["peak_rss_kb"] = result.peakRssKb;
+        results.push_back(entry);
+    }
+
+    if(options.json) {
+        json report;
+        report["corpus"] = {
+            { "files", options.corpus.files },
+            { "decls", options.corpus.decls },
+            { "include_depth", options.corpus.includeDepth },
+            { "template_density", options.corpus.templateDensity },
+            { "language", options.corpus.cxx ? "c++" : "c" },
+            { "bytes", corpusBytes },
+        };
+        report["clangtags_args"] = options.clangtagsArgs;
+        report["runs"] = options.runs;
+        report["results"] = results;
+        std::cout << report.dump(2) << std::endl;
+    }
+    else {
+        std::cout << "corpus: " << options.corpus.files << " files, " << options.corpus.decls << " decls each, include depth "
+                  << options.corpus.includeDepth << ", " << (options.corpus.cxx ? "c++" : "c") << ", "
+                  << corpusBytes << " bytes, " << cursors << " cursors\n\n";
+
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-8s %10s %14s %12s %14s\n", "format", "seconds", "cursors/s", "MB/s", "peak RSS MB");
+        std::cout << line;
+        for(auto& entry : results) {
+            std::snprintf(line, sizeof(line), "%-8s %10.3f %14.0f %12.1f %14.1f\n",
+                          entry["format"].get<std::string>().c_str(),
+                          entry["seconds"].get<double>(),
+                          entry["cursors_per_second"].get<double>(),
+                          entry["bytes_per_second"].get<double>() / (1024 * 1024),
+                          entry["peak_rss_kb"].get<long>() / 1024.0);
+            std::cout << line;
+        }
+    }
+
+    if(temporary && !options.keepCorpus) {
+        remove_corpus(directory, created);
+    }
+    else {
+        std::cerr << "corpus kept in " << directory << std::endl;
+    }
+
+    return status;
+}
@@ -0,0 +1,215 @@
+#include "cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include "file_time.h"
+#include "hash.h"
+
+std::string to_hex(uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+
+    std::string hex(16, '0');
+    for(int i = 15; i >= 0; i--) {
+        hex[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+    return hex;
+}
+
+IndexCache::IndexCache(const std::string& directory, const std::string& kind) : directory(directory), kind(kind) {
+    mkdir(directory.c_str(), 0777);
+}
+
+std::string IndexCache::entry_path(const std::string& identity) const {
+    return directory + "/" + to_hex(fnv1a(identity.data(), identity.size())) + "." + kind;
+}
+
+bool IndexCache::hash_file(const std::string& path, uint64_t& hash) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = fileHashes.find(path);
+        if(it != fileHashes.end()) {
+            hash = it->second;
+            return true;
+        }
+    }
+
+    std::ifstream in(path, std::ios::binary);
+    if(!in) {
+        return false;
+    }
+
+    hash = fnv1a(nullptr, 0);
+    char chunk[64 * 1024];
+    while(in.read(chunk, sizeof(chunk)) || in.gcount() > 0) {
+        hash = fnv1a(chunk, static_cast<size_t>(in.gcount()), hash);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    fileHashes[path] = hash;
+    return true;
+}
+
+std::string IndexCache::compute_key(const std::string& identity, const std::vector<std::string>& files) {
+    auto key = fnv1a(identity.data(), identity.size());
+
+    for(auto& file : files) {
+        uint64_t contents;
+        if(!hash_file(file, contents)) {
+            return std::string();
+        }
+
+        key = fnv1a(file.data(), file.size() + 1, key);
+        key = fnv1a(reinterpret_cast<const char *>(&contents), sizeof(contents), key);
+    }
+
+    return to_hex(key);
+}
+
+bool IndexCache::is_fresh(const std::string& identity) {
+    std::ifstream manifestFile(entry_path(identity) + ".manifest");
+    if(!manifestFile) {
+        return false;
+    }
+
+    json manifest;
+    try {
+        manifest = json::parse(manifestFile);
+    }
+    catch(const json::exception&) {
+        return false;
+    }
+
+    if(manifest.value("identity", "") != identity) {
+        return false;
+    }
+
+    auto key = compute_key(identity, manifest.value("files", std::vector<std::string>()));
+    return !key.empty() && key == manifest.value("key", "");
+}
+
+bool IndexCache::write_manifest(const std::string& identity, const std::vector<std::string>& files) {
+    auto key = compute_key(identity, files);
+    if(key.empty()) {
+        return false;
+    }
+
+    json manifest;
+    manifest["identity"] = identity;
+    manifest["key"] = key;
+    manifest["files"] = files;
+
+    auto path = entry_path(identity) + ".manifest";
+    std::ofstream out(path + ".tmp");
+    out << manifest.dump();
+    out.close();
+
+    return out && std::rename((path + ".tmp").c_str(), path.c_str()) == 0;
+}
+
+void IndexCache::remove_manifest(const std::string& identity) {
+    std::remove((entry_path(identity) + ".manifest").c_str());
+}
+
+bool IndexCache::replay(const std::string& identity, RecordSink& sink) {
+    if(!is_fresh(identity)) {
+        return false;
+    }
+
+    auto path = entry_path(identity);
+    std::ifstream records(path, std::ios::binary);
+    if(!records) {
+        return false;
+    }
+
+    // records are stored as CBOR, each prefixed with its little-endian size.
+    // The whole entry is decoded before anything reaches sink, so that a
+    // damaged one can still be treated as a miss.
+    std::vector<Record> decoded;
+    try {
+        std::vector<uint8_t> buffer;
+        unsigned char size[4];
+        while(records.read(reinterpret_cast<char *>(size), sizeof(size))) {
+            buffer.resize(size[0] | size[1] << 8 | size[2] << 16 | static_cast<uint32_t>(size[3]) << 24);
+            if(!records.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()))) {
+                throw std::runtime_error("truncated cache entry: " + path);
+            }
+
+            decoded.emplace_back();
+            record_from_json(json::from_cbor(buffer), decoded.back());
+        }
+        if(records.gcount() != 0) {
+            throw std::runtime_error("truncated cache entry: " + path);
+        }
+    }
+    catch(const std::exception&) {
+        remove_manifest(identity);
+        return false;
+    }
+
+    for(auto& record : decoded) {
+        sink.write(record);
+    }
+
+    return true;
+}
+
+CacheWriter::CacheWriter(IndexCache& cache, const std::string& identity, RecordSink& target)
+    : cache(cache), identity(identity), target(target), path(cache.entry_path(identity)),
+      started(std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count()) {
+    records.open(path + ".tmp", std::ios::binary | std::ios::trunc);
+}
+
+CacheWriter::~CacheWriter() {
+    if(!committed) {
+        records.close();
+        std::remove((path + ".tmp").c_str());
+    }
+}
+
+void CacheWriter::write(const Record& record) {
+    buffer.clear();
+    {
+        ArenaScope scope(arena);
+        RecordJson::to_cbor(record_to_json<RecordJson>(record), buffer);
+    }
+    arena.reset();
+
+    auto size = static_cast<uint32_t>(buffer.size());
+    char prefix[4] = {
+        static_cast<char>(size & 0xff), static_cast<char>((size >> 8) & 0xff),
+        static_cast<char>((size >> 16) & 0xff), static_cast<char>((size >> 24) & 0xff)
+    };
+    records.write(prefix, sizeof(prefix));
+    records.write(reinterpret_cast<const char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+
+    target.write(record);
+}
+
+void CacheWriter::flush() {
+    target.flush();
+}
+
+void CacheWriter::commit(const std::vector<std::string>& files) {
+    records.close();
+    if(!records) {
+        return;
+    }
+
+    for(auto& file : files) {
+        auto mtime = file_mtime(file);
+        if(mtime < 0 || mtime >= started) {
+            return;
+        }
+    }
+
+    // drop the old manifest before replacing the records it describes
+    cache.remove_manifest(identity);
+    if(std::rename((path + ".tmp").c_str(), path.c_str()) != 0) {
+        return;
+    }
+
+    committed = true;
+    cache.write_manifest(identity, files);
+}
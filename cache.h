@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "output.h"
+
+std::string to_hex(uint64_t value);
+
+// On-disk cache of per-TU results: the records produced for each TU, or its
+// serialized AST.
+//
+// Entries are found by the TU's identity (file, flags, directory) and are only
+// served while the key stored with them still matches: a hash over the identity
+// and the contents of every file the TU included the last time it was parsed.
+class IndexCache {
+public:
+    // Entries live in directory as <hash>.<kind>, next to <hash>.<kind>.manifest,
+    // so caches of different kinds can share a directory.
+    IndexCache(const std::string& directory, const std::string& kind);
+
+    // Writes the cached records for identity into sink and returns true, or
+    // returns false without touching sink if the entry is missing or stale.
+    bool replay(const std::string& identity, RecordSink& sink);
+
+    // Whether the manifest for identity exists and its key is still current.
+    bool is_fresh(const std::string& identity);
+    // Call once the entry's data files are in place.
+    bool write_manifest(const std::string& identity, const std::vector<std::string>& files);
+    void remove_manifest(const std::string& identity);
+
+    // Returns an empty string if one of the files can no longer be read.
+    std::string compute_key(const std::string& identity, const std::vector<std::string>& files);
+
+    // Where the entry's data lives; the manifest is this plus ".manifest".
+    std::string entry_path(const std::string& identity) const;
+
+private:
+    bool hash_file(const std::string& path, uint64_t& hash);
+
+    std::string directory;
+    std::string kind;
+
+    // TUs share most of their headers, so each file is read once per run
+    std::mutex mutex;
+    std::unordered_map<std::string, uint64_t> fileHashes;
+};
+
+// Passes records on to target while recording them for the cache. Nothing is
+// stored unless commit() is called once the TU parsed successfully.
+class CacheWriter : public RecordSink {
+public:
+    CacheWriter(IndexCache& cache, const std::string& identity, RecordSink& target);
+    ~CacheWriter() override;
+
+    void write(const Record& record) override;
+    void flush() override;
+
+    // Stores the entry unless one of files was modified after the writer
+    // was created, i.e. while the TU was being parsed: the key is hashed
+    // from the files as they are now, which would not match the records.
+    void commit(const std::vector<std::string>& files);
+
+private:
+    IndexCache& cache;
+    std::string identity;
+    RecordSink& target;
+
+    std::string path;
+    std::ofstream records;
+    std::vector<uint8_t> buffer;
+    Arena arena;
+    // wall clock time in nanoseconds when the writer was created
+    int64_t started;
+    bool committed = false;
+};
@@ -0,0 +1,325 @@
+#include "daemon.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+bool write_all(int fd, const std::string& data) {
+    size_t written = 0;
+    while(written < data.size()) {
+        auto n = ::write(fd, data.data() + written, data.size() - written);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void serve_connection(int fd, const SymbolIndex& index) {
+    // without a limit, a client that never sends a newline would have its
+    // connection buffer everything it sends
+    auto reject = [fd]() {
+        json response = { { "error", "request longer than " + std::to_string(maxRequestSize) + " bytes" } };
+        write_all(fd, response.dump() + "\n");
+        close(fd);
+    };
+
+    std::string pending;
+    char chunk[4096];
+
+    while(true) {
+        auto n = ::read(fd, chunk, sizeof(chunk));
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        pending.append(chunk, static_cast<size_t>(n));
+
+        size_t newline;
+        while((newline = pending.find('\n')) != std::string::npos) {
+            if(newline > maxRequestSize) {
+                reject();
+                return;
+            }
+            auto line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+
+            json response;
+            try {
+                response = index.query(json::parse(line));
+            }
+            catch(const json::exception& e) {
+                response = { { "error", e.what() } };
+            }
+
+            if(!write_all(fd, response.dump() + "\n")) {
+                close(fd);
+                return;
+            }
+        }
+
+        if(pending.size() > maxRequestSize) {
+            reject();
+            return;
+        }
+    }
+
+    close(fd);
+}
+
+}
+
+void SymbolIndex::add(const Record& record) {
+    auto row = static_cast<uint32_t>(records.size());
+    records.append(record);
+
+    if(!record.usr.empty()) {
+        byUsr.emplace(records.usr[row], row);
+    }
+    if(!record.spelling.empty()) {
+        bySpelling.emplace(records.spelling[row], row);
+    }
+    if(record.has(RecordFlag_HasFileName)) {
+        byFile[records.fileName[row]].rows.push_back(row);
+    }
+}
+
+void SymbolIndex::finalize() {
+    auto& startOffset = records.startOffset;
+    auto& endOffset = records.endOffset;
+
+    for(auto& file : byFile) {
+        auto& tree = file.second;
+        auto& rows = tree.rows;
+        std::stable_sort(rows.begin(), rows.end(), [&startOffset](uint32_t a, uint32_t b) {
+            return startOffset[a] < startOffset[b];
+        });
+
+        // bottom up, as in cgranges: leaves are the even indices, and a
+        // missing right child stands in for the subtree that ends the array
+        auto n = rows.size();
+        tree.maxEnd.assign(n, 0);
+        if(n == 0) {
+            continue;
+        }
+
+        size_t lastIndex = 0;
+        unsigned last = 0;
+        for(size_t i = 0; i < n; i += 2) {
+            lastIndex = i;
+            last = tree.maxEnd[i] = endOffset[rows[i]];
+        }
+
+        int k = 1;
+        for(; (static_cast<size_t>(1) << k) <= n; k++) {
+            size_t x = static_cast<size_t>(1) << (k - 1);
+            for(size_t i = (x << 1) - 1; i < n; i += x << 2) {
+                auto left = tree.maxEnd[i - x];
+                auto right = i + x < n ? tree.maxEnd[i + x] : last;
+                tree.maxEnd[i] = std::max(endOffset[rows[i]], std::max(left, right));
+            }
+
+            lastIndex = (lastIndex >> k & 1) ? lastIndex - x : lastIndex + x;
+            if(lastIndex < n && tree.maxEnd[lastIndex] > last) {
+                last = tree.maxEnd[lastIndex];
+            }
+        }
+        tree.rootLevel = k - 1;
+    }
+}
+
+json SymbolIndex::row_to_json(uint32_t row) const {
+    Record record;
+    records.get(row, record);
+    return record_to_json(record);
+}
+
+json SymbolIndex::lookup(const RowMap& map, const std::string& key, size_t limit) const {
+    json results = json::array();
+
+    auto id = records.strings.find(key);
+    if(id == StringPool::npos) {
+        return results;
+    }
+
+    auto range = map.equal_range(id);
+    for(auto it = range.first; it != range.second && results.size() < limit; ++it) {
+        results.push_back(row_to_json(it->second));
+    }
+
+    return results;
+}
+
+json SymbolIndex::lookup_position(const std::string& file, unsigned offset, size_t limit) const {
+    json results = json::array();
+
+    auto it = byFile.find(records.strings.find(file));
+    if(it == byFile.end()) {
+        return results;
+    }
+
+    // everything starting at or before offset that is still open at it,
+    // skipping the subtrees whose maxEnd says nothing in them reaches it
+    auto& startOffset = records.startOffset;
+    auto& endOffset = records.endOffset;
+    auto& tree = it->second;
+    auto& rows = tree.rows;
+    auto n = rows.size();
+
+    std::vector<uint32_t> enclosing;
+    struct Node {
+        size_t index;
+        int level;
+        bool leftDone;
+    };
+    std::vector<Node> stack;
+    if(tree.rootLevel >= 0) {
+        stack.push_back({ (static_cast<size_t>(1) << tree.rootLevel) - 1, tree.rootLevel, false });
+    }
+
+    while(!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+
+        if(node.level <= 3) {
+            // small enough to scan
+            auto begin = node.index >> node.level << node.level;
+            auto end = std::min(n, begin + (static_cast<size_t>(1) << (node.level + 1)) - 1);
+            for(auto i = begin; i < end && startOffset[rows[i]] <= offset; i++) {
+                if(endOffset[rows[i]] >= offset) {
+                    enclosing.push_back(rows[i]);
+                }
+            }
+        }
+        else if(!node.leftDone) {
+            stack.push_back({ node.index, node.level, true });
+            // the left child may lie past the end, standing for nothing
+            auto left = node.index - (static_cast<size_t>(1) << (node.level - 1));
+            if(left >= n || tree.maxEnd[left] >= offset) {
+                stack.push_back({ left, node.level - 1, false });
+            }
+        }
+        else if(node.index < n && startOffset[rows[node.index]] <= offset) {
+            if(endOffset[rows[node.index]] >= offset) {
+                enclosing.push_back(rows[node.index]);
+            }
+            stack.push_back({ node.index + (static_cast<size_t>(1) << (node.level - 1)), node.level - 1, false });
+        }
+    }
+
+    // innermost first
+    std::stable_sort(enclosing.begin(), enclosing.end(), [&startOffset, &endOffset](uint32_t a, uint32_t b) {
+        return endOffset[a] - startOffset[a] < endOffset[b] - startOffset[b];
+    });
+
+    for(auto row : enclosing) {
+        if(results.size() >= limit) {
+            break;
+        }
+        results.push_back(row_to_json(row));
+    }
+
+    return results;
+}
+
+json SymbolIndex::query(const json& request) const {
+    if(!request.is_object()) {
+        return { { "error", "request must be an object" } };
+    }
+
+    auto limit = request.value("limit", static_cast<size_t>(-1));
+
+    json results;
+    if(request.count("usr")) {
+        results = lookup(byUsr, request["usr"].get<std::string>(), limit);
+    }
+    else if(request.count("spelling")) {
+        results = lookup(bySpelling, request["spelling"].get<std::string>(), limit);
+    }
+    else if(request.count("file") && request.count("offset")) {
+        results = lookup_position(request["file"].get<std::string>(), request["offset"].get<unsigned>(), limit);
+    }
+    else {
+        return { { "error", "expected usr, spelling, or file and offset" } };
+    }
+
+    return { { "results", std::move(results) } };
+}
+
+void serve_unix_socket(const std::string& path, const SymbolIndex& index) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("socket path too long: " + path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    // a client hanging up mid-response must not take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+    }
+
+    unlink(path.c_str());
+    if(bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        auto error = std::string("failed to listen on ") + path + ": " + std::strerror(errno);
+        close(fd);
+        throw std::runtime_error(error);
+    }
+
+    // the threads are detached, so they count themselves out
+    std::mutex mutex;
+    std::condition_variable finished;
+    unsigned active = 0;
+
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&active]() { return active < maxConnections; });
+        }
+
+        int client = accept(fd, nullptr, nullptr);
+        if(client < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            auto error = std::string("accept: ") + std::strerror(errno);
+            close(fd);
+            // the connections still running use the counter on this frame
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [&active]() { return active == 0; });
+            throw std::runtime_error(error);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active++;
+        }
+        std::thread([client, &index, &mutex, &finished, &active]() {
+            serve_connection(client, index);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            active--;
+            finished.notify_one();
+        }).detach();
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "record.h"
+
+// In-memory symbol index answering lookups by USR, by spelling, and by
+// position within a file.
+class SymbolIndex {
+public:
+    void add(const Record& record);
+    // Call once after the last add(), before querying.
+    void finalize();
+
+    // request is one of {"usr": s}, {"spelling": s} or {"file": s, "offset": n},
+    // optionally with "limit". Returns {"results": [...]} or {"error": s}.
+    json query(const json& request) const;
+
+    size_t size() const { return records.size(); }
+    size_t memory_usage() const { return records.memory_usage(); }
+
+private:
+    // keyed by ids into records.strings
+    typedef std::unordered_multimap<uint32_t, uint32_t> RowMap;
+
+    // A file's records as an implicit interval tree over their extents: rows
+    // sorted by start offset form a complete binary tree in in-order layout,
+    // where the node at index i on level k has its children at i -/+ 2^(k-1)
+    // and maxEnd[i] is the largest end offset in its subtree.
+    struct FileIntervals {
+        std::vector<uint32_t> rows;
+        std::vector<unsigned> maxEnd;
+        // level of the root, -1 while empty
+        int rootLevel = -1;
+    };
+
+    json lookup(const RowMap& map, const std::string& key, size_t limit) const;
+    json lookup_position(const std::string& file, unsigned offset, size_t limit) const;
+    json row_to_json(uint32_t row) const;
+
+    RecordStore records;
+    RowMap byUsr;
+    RowMap bySpelling;
+    std::unordered_map<uint32_t, FileIntervals> byFile;
+};
+
+// Connections served at once by serve_unix_socket.
+const unsigned maxConnections = 64;
+// Longest request line, newline excluded. A client sending a longer one gets
+// an error and is disconnected.
+const size_t maxRequestSize = 64 * 1024;
+
+// Accepts connections on a Unix domain socket at path and answers one
+// newline-terminated JSON request per line, one response line each. Each
+// connection gets its own thread, up to maxConnections at a time; further
+// clients wait in the listen backlog. Does not return unless setting up fails.
+void serve_unix_socket(const std::string& path, const SymbolIndex& index);
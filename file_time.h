@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+
+// Modification time in nanoseconds, or -1 if the file is gone.
+inline int64_t file_mtime(const std::string& path) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
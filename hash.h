@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+const uint64_t fnv1aOffsetBasis = 0xcbf29ce484222325ull;
+
+// 64-bit FNV-1a of size bytes at data, continuing from hash to cover several
+// pieces in a row. The USR index and the cache keys store these hashes, so
+// changing the function changes their file formats.
+inline uint64_t fnv1a(const char *data, size_t size, uint64_t hash = fnv1aOffsetBasis) {
+    for(size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
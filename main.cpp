@@ -1,10 +1,32 @@
 #include <iostream>
 #include <clang-c/Index.h>
 #include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <string>
 #include <clang-c/CXString.h>
+#include <sys/stat.h>
 #include "json.hpp"
-
-using json = nlohmann::json;
+#include "output.h"
+#include "cache.h"
+#include "file_time.h"
+#include "daemon.h"
+#include "usr_index.h"
+#include "trigram_index.h"
+#include "trace.h"
+#include "tags.h"
+#include "xref_graph.h"
 
 std::ostream& operator<<(std::ostream& stream, const CXString& str) {
     auto cstr = clang_getCString(str);
@@ -45,328 +67,1649 @@ public:
     CXString str{nullptr};
 };
 
+// Optional extras cursor_visitor adds to records.
+struct VisitOptions {
+    // The RecordFields to ask libclang for. "qualified_name", e.g.
+    // ns::Class::method, is left out unless asked for by name.
+    uint32_t fields = RecordField_All & ~RecordField_QualifiedName;
+    // Only write declarations, skipping over statements, expressions and
+    // references instead of descending into them.
+    bool declarationsOnly = false;
+    // With declarationsOnly, write macro definitions as well, which libclang
+    // does not count as declarations.
+    bool macroDefinitions = false;
+
+    // Which files' cursors to write. A cursor outside them is skipped along
+    // with everything below it.
+    bool mainFileOnly = false;
+    bool skipSystemHeaders = false;
+    // if not empty, only files whose names, as clang reports them, start
+    // with one of these
+    std::vector<std::string> pathPrefixes;
+
+    bool filters_locations() const {
+        return mainFileOnly || skipSystemHeaders || !pathPrefixes.empty();
+    }
+};
+
+// The options that change which records a TU produces, for cache keys.
+// Empty for the defaults.
+std::string visit_identity(const VisitOptions& options) {
+    std::string identity;
+    if(options.fields != VisitOptions().fields) {
+        identity += "\n--fields=" + std::to_string(options.fields);
+    }
+    if(options.declarationsOnly) {
+        identity += "\n--declarations";
+    }
+    if(options.macroDefinitions) {
+        identity += "\n--macro-definitions";
+    }
+    if(options.mainFileOnly) {
+        identity += "\n--main-file-only";
+    }
+    if(options.skipSystemHeaders) {
+        identity += "\n--skip-system-headers";
+    }
+    for(auto& prefix : options.pathPrefixes) {
+        identity += "\n--project-prefix=" + prefix;
+    }
+    return identity;
+}
+
+struct VisitContext {
+    RecordSink *sink;
+    const VisitOptions *options;
+    // reused for every cursor of the TU; fields outside the mask are never
+    // written, so they keep their defaults throughout
+    Record record;
+
+    // cursors come in long runs from the same file, so the prefix check is
+    // only redone when the file changes
+    CXFile lastFile = nullptr;
+    bool lastFileIncluded = false;
+};
+
+// Copies str into out, returning false (and leaving out empty) for a null string.
+bool assign_string(std::string& out, const CXString& str) {
+    auto cstr = clang_getCString(str);
+    if(cstr == nullptr) {
+        out.clear();
+        return false;
+    }
+    out.assign(cstr);
+    return true;
+}
+
+std::string qualified_name(CXCursor cursor) {
+    std::string name;
+
+    for(; !clang_Cursor_isNull(cursor) && clang_isDeclaration(clang_getCursorKind(cursor));
+        cursor = clang_getCursorSemanticParent(cursor)) {
+        ManagedCXString spelling(clang_getCursorSpelling(cursor));
+        auto cstr = clang_getCString(spelling);
+        if(cstr == nullptr || *cstr == '\0') {
+            // anonymous namespaces and records don't add a component
+            continue;
+        }
+
+        name = name.empty() ? std::string(cstr) : std::string(cstr) + "::" + name;
+    }
+
+    return name;
+}
+
+bool location_included(CXSourceLocation location, VisitContext& context) {
+    auto& options = *context.options;
+
+    if(options.mainFileOnly && !clang_Location_isFromMainFile(location)) {
+        return false;
+    }
+    if(options.skipSystemHeaders && clang_Location_isInSystemHeader(location)) {
+        return false;
+    }
+
+    if(!options.pathPrefixes.empty()) {
+        CXFile file;
+        clang_getInstantiationLocation(location, &file, nullptr, nullptr, nullptr);
+        if(file != context.lastFile) {
+            ManagedCXString fileName(clang_getFileName(file));
+            std::string name;
+            assign_string(name, fileName);
+
+            context.lastFile = file;
+            context.lastFileIncluded = std::any_of(options.pathPrefixes.begin(), options.pathPrefixes.end(), [&name](const std::string& prefix) {
+                return name.compare(0, prefix.size(), prefix) == 0;
+            });
+        }
+        return context.lastFileIncluded;
+    }
+
+    return true;
+}
+
+// Fills the context's record from cursor and hands it to the sink.
+void write_cursor(CXCursor cursor, CXCursorKind kind, CXSourceLocation location, VisitContext& context) {
+    auto fields = context.options->fields;
+    auto& record = context.record;
+    record.flags = 0;
+
+    if(fields & RecordField_Location) {
+        CXFile file;
+        clang_getInstantiationLocation(location, &file, &record.line, &record.column, &record.offset);
+        ManagedCXString fileName(clang_getFileName(file));
+        record.set(RecordFlag_HasFileName, assign_string(record.fileName, fileName));
+    }
+
+    if(fields & RecordField_Extent) {
+        auto extent = clang_getCursorExtent(cursor);
+        auto start = clang_getRangeStart(extent);
+        auto end = clang_getRangeEnd(extent);
+        clang_getInstantiationLocation(start, nullptr, &record.startLine, &record.startColumn, &record.startOffset);
+        clang_getInstantiationLocation(end, nullptr, &record.endLine, &record.endColumn, &record.endOffset);
+    }
+
+    record.kind = kind;
+    if(fields & RecordField_KindName) {
+        ManagedCXString kindName(clang_getCursorKindSpelling(kind));
+        assign_string(record.kindName, kindName);
+    }
+
+    if(fields & (RecordField_Type | RecordField_TypeName)) {
+        auto type = clang_getCursorType(cursor);
+        record.type = type.kind;
+        if(fields & RecordField_TypeName) {
+            ManagedCXString typeName(clang_getTypeSpelling(type));
+            assign_string(record.typeName, typeName);
+        }
+    }
+
+    if(fields & RecordField_Spelling) {
+        ManagedCXString spelling(clang_getCursorSpelling(cursor));
+        assign_string(record.spelling, spelling);
+    }
+    if(fields & RecordField_Display) {
+        ManagedCXString displayName(clang_getCursorDisplayName(cursor));
+        assign_string(record.display, displayName);
+    }
+
+    if(fields & RecordField_IsDefinition) {
+        record.set(RecordFlag_Definition, clang_isCursorDefinition(cursor) != 0);
+    }
+    if(fields & RecordField_Definition) {
+        auto definition = clang_getCursorDefinition(cursor);
+        if(!clang_Cursor_isNull(definition)) {
+            ManagedCXString definitionUSR(clang_getCursorUSR(definition));
+            record.set(RecordFlag_HasDefinition, assign_string(record.definition, definitionUSR));
+        }
+    }
+
+    if(fields & RecordField_IsStatic) {
+        record.set(RecordFlag_Static, clang_CXXMethod_isStatic(cursor) != 0);
+    }
+    if(fields & RecordField_IsReference) {
+        record.set(RecordFlag_Reference, clang_isReference(cursor.kind) != 0);
+    }
+
+    if(fields & RecordField_Usr) {
+        ManagedCXString usr(clang_getCursorUSR(cursor));
+        assign_string(record.usr, usr);
+    }
+
+    if(fields & RecordField_ReferencedUsr) {
+        auto referenced = clang_getCursorReferenced(cursor);
+        if(!clang_Cursor_isNull(referenced)) {
+            ManagedCXString referencedUSR(clang_getCursorUSR(referenced));
+            record.set(RecordFlag_HasReferenced, assign_string(record.referencedUSR, referencedUSR));
+        }
+    }
+
+    if(fields & RecordField_Language) {
+        switch(clang_getCursorLanguage(cursor)) {
+            case CXLanguage_C:
+                record.language = RecordLanguage_C;
+                break;
+            case CXLanguage_CPlusPlus:
+                record.language = RecordLanguage_Cpp;
+                break;
+            default:
+                record.language = RecordLanguage_None;
+                break;
+        }
+    }
+
+    if((fields & RecordField_QualifiedName) && clang_isDeclaration(kind)) {
+        record.qualifiedName = qualified_name(cursor);
+        record.set(RecordFlag_HasQualifiedName, true);
+    }
+
+    context.sink->write(record);
+}
+
 CXChildVisitResult cursor_visitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
-    auto location = clang_getCursorLocation(cursor);
-    CXFile file;
-    unsigned int line, column, offset;
-    clang_getInstantiationLocation(location, &file, &line, &column, &offset);
-    ManagedCXString fileName(clang_getFileName(file));
-
-    auto extent = clang_getCursorExtent(cursor);
-    auto start = clang_getRangeStart(extent);
-    auto end = clang_getRangeEnd(extent);
-    unsigned int startLine, startColumn, startOffset;
-    unsigned int endLine, endColumn, endOffset;
-    clang_getInstantiationLocation(start, nullptr, &startLine, &startColumn, &startOffset);
-    clang_getInstantiationLocation(end, nullptr, &endLine, &endColumn, &endOffset);
-
-    auto language = clang_getCursorLanguage(cursor);
+    auto context = static_cast<VisitContext*>(client_data);
     auto kind = clang_getCursorKind(cursor);
-    ManagedCXString kindName(clang_getCursorKindSpelling(kind));
-    auto type = clang_getCursorType(cursor);
-    ManagedCXString typeName(clang_getTypeSpelling(type));
-    ManagedCXString spelling(clang_getCursorSpelling(cursor));
-    ManagedCXString displayName(clang_getCursorDisplayName(cursor));
-    auto isDefinition = static_cast<bool>(clang_isCursorDefinition(cursor));
-    auto definition = clang_getCursorDefinition(cursor);
 
-    auto isStatic = static_cast<bool>(clang_CXXMethod_isStatic(cursor));
-    auto isReference = static_cast<bool>(clang_isReference(cursor.kind));
-    auto referenced = clang_getCursorReferenced(cursor);
+    // declarations only ever nest inside other declarations, so nothing below
+    // a function body, an expression or a reference is of interest
+    if(context->options->declarationsOnly && !clang_isDeclaration(kind) &&
+       !(context->options->macroDefinitions && kind == CXCursor_MacroDefinition)) {
+        return CXChildVisit_Continue;
+    }
+
+    auto location = clang_getCursorLocation(cursor);
+    if(context->options->filters_locations() && !location_included(location, *context)) {
+        return CXChildVisit_Continue;
+    }
 
-    ManagedCXString usr(clang_getCursorUSR(cursor));
+    write_cursor(cursor, kind, location, *context);
 
-    json *pjson = static_cast<json*>(client_data);
+    return CXChildVisit_Recurse;
+}
 
-    json j;
-    j["location"] = json::object({ { "fileName", fileName }, { "line", line }, { "column", column }, { "offset", offset } });
-    j["extent"] = json::object({
-        { "start", {
-            { "line", startLine },
-            { "column", startColumn },
-            { "offset", startOffset }
-        }},
-        { "end", {
-           { "line", endLine },
-           { "column", endColumn },
-           { "offset", endOffset }
-      }},
-    });
-    j["kind"] = kind;
-    j["kind_name"] = kindName;
-    j["type"] = type.kind;
-    j["type_name"] = typeName;
-    j["spelling"] = spelling;
-    j["display"] = displayName;
-    j["is_definition"] = isDefinition;
-
-    if(!clang_Cursor_isNull(definition)) {
-        ManagedCXString definitionUSR(clang_getCursorUSR(definition));
-        j["definition"] = definitionUSR;
+// The indexer callbacks share write_cursor with cursor_visitor, so both
+// engines produce the same records for the same cursor. There are no
+// subtrees to prune here, only single cursors to drop.
+void index_cursor(CXCursor cursor, VisitContext& context) {
+    auto location = clang_getCursorLocation(cursor);
+    if(context.options->filters_locations() && !location_included(location, context)) {
+        return;
     }
-    else {
-        j["definition"] = nullptr;
+
+    write_cursor(cursor, clang_getCursorKind(cursor), location, context);
+}
+
+void index_declaration(CXClientData client_data, const CXIdxDeclInfo *info) {
+    index_cursor(info->cursor, *static_cast<VisitContext*>(client_data));
+}
+
+void index_entity_reference(CXClientData client_data, const CXIdxEntityRefInfo *info) {
+    auto context = static_cast<VisitContext*>(client_data);
+    if(!context->options->declarationsOnly) {
+        index_cursor(info->cursor, *context);
     }
+}
+
+struct TranslationUnitJob {
+    // Source file to parse, or empty when it is named somewhere in args.
+    std::string fileName;
+    std::vector<std::string> args;
+    // Directory relative paths in args are resolved against, if any.
+    std::string directory;
+};
 
-    j["is_static"] = isStatic;
-    j["is_reference"] = isReference;
-    j["usr"] = usr;
+enum class Engine {
+    // clang_parseTranslationUnit2 and clang_visitChildren over the whole AST
+    Visit,
+    // clang_indexSourceFile, which reports only declarations and references
+    // and skips the bodies of headers already indexed by the same worker
+    Index,
+};
 
-    if(!clang_Cursor_isNull(referenced)) {
-        ManagedCXString referencedUSR(clang_getCursorUSR(referenced));
-        j["referencedUSR"] = referencedUSR;
+Engine parse_engine(const std::string& name) {
+    if(name == "visit") {
+        return Engine::Visit;
     }
-    else {
-        j["referencedUSR"] = nullptr;
+    else if(name == "index") {
+        return Engine::Index;
     }
 
-    switch(language) {
-        case CXLanguage_C:
-            j["language"] = "c";
-            break;
-        case CXLanguage_CPlusPlus:
-            j["language"] = "cpp";
-            break;
+    throw std::runtime_error("unknown engine: " + name);
+}
+
+// What happens to a TU that libclang needs more than --memory-budget for.
+enum class OverBudget {
+    // parse it again without function bodies or the preprocessing record,
+    // and skip it if that is still too big
+    Degrade,
+    Skip,
+};
+
+OverBudget parse_over_budget(const std::string& name) {
+    if(name == "degrade") {
+        return OverBudget::Degrade;
+    }
+    else if(name == "skip") {
+        return OverBudget::Skip;
+    }
+
+    throw std::runtime_error("unknown --over-budget action: " + name);
+}
+
+// A byte count with an optional K, M or G (binary) suffix.
+uint64_t parse_byte_size(const std::string& size) {
+    size_t end = 0;
+    uint64_t bytes = 0;
+    try {
+        bytes = std::stoull(size, &end);
+    }
+    catch(const std::exception&) {
+        end = 0;
+    }
+
+    if(end == 0 || end + 1 < size.size()) {
+        throw std::runtime_error("invalid size: " + size);
+    }
+    if(end == size.size()) {
+        return bytes;
+    }
+
+    switch(toupper(static_cast<unsigned char>(size[end]))) {
+        case 'K':
+            return bytes << 10;
+        case 'M':
+            return bytes << 20;
+        case 'G':
+            return bytes << 30;
         default:
-            j["language"] = nullptr;
+            throw std::runtime_error("invalid size: " + size);
+    }
+}
+
+struct Options {
+    unsigned jobs = 0;
+    std::string batchFile;
+    std::string compileCommands;
+    OutputFormat format = OutputFormat::Json;
+    bool intern = false;
+    // memory for --format ctags and etags to sort in before it spills to disk
+    uint64_t sortMemory = 256 << 20;
+    // RecordFields to output, 0 for all of them
+    uint32_t fields = 0;
+    bool declarationsOnly = false;
+    Engine engine = Engine::Visit;
+    // bytes of libclang memory a TU may use, 0 for no limit
+    uint64_t memoryBudget = 0;
+    OverBudget overBudget = OverBudget::Degrade;
+    // where --stats goes, "-" for stderr
+    std::string statsFile;
+    // add hardware counters to --stats
+    bool perfCounters = false;
+    std::string traceFile;
+    bool mainFileOnly = false;
+    bool skipSystemHeaders = false;
+    std::vector<std::string> projectPrefixes;
+    std::string cacheDirectory;
+    std::string astCacheDirectory;
+    bool watch = false;
+    std::string daemonSocket;
+    std::string usrIndexFile;
+    // with --lookup-usr, the USRs to resolve in usrIndexFile instead of indexing
+    bool lookupUsr = false;
+    std::string xrefGraphFile;
+    // with --lookup-references, the USRs to list the references of from
+    // xrefGraphFile instead of indexing
+    bool lookupReferences = false;
+    std::string trigramIndexFile;
+    // with --search or --fuzzy-search, the queries to run against
+    // trigramIndexFile instead of indexing
+    bool search = false;
+    bool fuzzy = false;
+    size_t searchLimit = 100;
+    unsigned watchInterval = 100;
+    std::vector<std::string> clangArgs;
+};
+
+Options parse_options(int argc, char *argv[]) {
+    Options options;
+
+    int i = 1;
+    for(; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if(arg == "--") {
+            i++;
+            break;
+        }
+        else if((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            options.jobs = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if(arg.compare(0, 7, "--jobs=") == 0) {
+            options.jobs = static_cast<unsigned>(std::stoul(arg.substr(7)));
+        }
+        else if(arg.size() > 2 && arg.compare(0, 2, "-j") == 0 && isdigit(arg[2])) {
+            options.jobs = static_cast<unsigned>(std::stoul(arg.substr(2)));
+        }
+        else if(arg == "--batch" && i + 1 < argc) {
+            options.batchFile = argv[++i];
+        }
+        else if(arg == "--format" && i + 1 < argc) {
+            options.format = parse_output_format(argv[++i]);
+        }
+        else if(arg.compare(0, 9, "--format=") == 0) {
+            options.format = parse_output_format(arg.substr(9));
+        }
+        else if(arg == "--cache" && i + 1 < argc) {
+            options.cacheDirectory = argv[++i];
+        }
+        else if(arg == "--ast-cache" && i + 1 < argc) {
+            options.astCacheDirectory = argv[++i];
+        }
+        else if(arg == "--watch") {
+            options.watch = true;
+        }
+        else if(arg == "--watch-interval" && i + 1 < argc) {
+            options.watchInterval = static_cast<unsigned>(std::stoul(argv[++i]));
+        }
+        else if(arg == "--daemon" && i + 1 < argc) {
+            options.daemonSocket = argv[++i];
+        }
+        else if(arg == "--usr-index" && i + 1 < argc) {
+            options.usrIndexFile = argv[++i];
+        }
+        else if(arg == "--lookup-usr" && i + 1 < argc) {
+            options.usrIndexFile = argv[++i];
+            options.lookupUsr = true;
+        }
+        else if(arg == "--xref-graph" && i + 1 < argc) {
+            options.xrefGraphFile = argv[++i];
+        }
+        else if(arg == "--lookup-references" && i + 1 < argc) {
+            options.xrefGraphFile = argv[++i];
+            options.lookupReferences = true;
+        }
+        else if(arg == "--trigram-index" && i + 1 < argc) {
+            options.trigramIndexFile = argv[++i];
+        }
+        else if((arg == "--search" || arg == "--fuzzy-search") && i + 1 < argc) {
+            options.trigramIndexFile = argv[++i];
+            options.search = true;
+            options.fuzzy = arg == "--fuzzy-search";
+        }
+        else if(arg == "--limit" && i + 1 < argc) {
+            options.searchLimit = std::stoul(argv[++i]);
+        }
+        else if(arg == "--fields" && i + 1 < argc) {
+            options.fields = parse_record_fields(argv[++i]);
+        }
+        else if(arg.compare(0, 9, "--fields=") == 0) {
+            options.fields = parse_record_fields(arg.substr(9));
+        }
+        else if(arg == "--declarations") {
+            options.declarationsOnly = true;
+        }
+        else if(arg == "--engine" && i + 1 < argc) {
+            options.engine = parse_engine(argv[++i]);
+        }
+        else if(arg.compare(0, 9, "--engine=") == 0) {
+            options.engine = parse_engine(arg.substr(9));
+        }
+        else if(arg == "--sort-memory" && i + 1 < argc) {
+            options.sortMemory = parse_byte_size(argv[++i]);
+        }
+        else if(arg == "--memory-budget" && i + 1 < argc) {
+            options.memoryBudget = parse_byte_size(argv[++i]);
+        }
+        else if(arg == "--over-budget" && i + 1 < argc) {
+            options.overBudget = parse_over_budget(argv[++i]);
+        }
+        else if(arg == "--stats" && i + 1 < argc) {
+            options.statsFile = argv[++i];
+        }
+        else if(arg == "--perf-counters") {
+            options.perfCounters = true;
+        }
+        else if(arg == "--trace" && i + 1 < argc) {
+            options.traceFile = argv[++i];
+        }
+        else if(arg == "--main-file-only") {
+            options.mainFileOnly = true;
+        }
+        else if(arg == "--skip-system-headers") {
+            options.skipSystemHeaders = true;
+        }
+        else if(arg == "--project-prefix" && i + 1 < argc) {
+            options.projectPrefixes.push_back(argv[++i]);
+        }
+        else if(arg == "--intern") {
+            options.intern = true;
+        }
+        else if((arg == "-p" || arg == "--compile-commands") && i + 1 < argc) {
+            options.compileCommands = argv[++i];
+        }
+        else {
+            // first argument we don't know about starts the clang command line
             break;
+        }
     }
 
-    pjson->push_back(j);
-    //std::cout << j.dump(2) << std::endl;
+    options.clangArgs.assign(argv + i, argv + argc);
 
-    return CXChildVisit_Recurse;
+    if(options.jobs == 0) {
+        options.jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    return options;
 }
 
-int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        throw std::runtime_error("argc < 2");
+std::vector<TranslationUnitJob> read_batch_file(const std::string& path, const std::vector<std::string>& args) {
+    std::ifstream in(path);
+    if(!in) {
+        throw std::runtime_error("failed to open batch file: " + path);
     }
 
-    auto index = clang_createIndex(false, 0);
+    std::vector<TranslationUnitJob> jobs;
+    std::string line;
+    while(std::getline(in, line)) {
+        if(line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        TranslationUnitJob job;
+        job.fileName = line;
+        job.args = args;
+        jobs.push_back(std::move(job));
+    }
+
+    return jobs;
+}
+
+// Splits a compile_commands.json "command" string the way a POSIX shell would,
+// minus expansions.
+std::vector<std::string> split_command(const std::string& command) {
+    std::vector<std::string> args;
+    std::string current;
+    bool inArg = false;
+    char quote = 0;
 
-    const char *pargs[] = {
-            "-I/Users/oscar/Projects/zircon/build-arm64/gen/global/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/uapp/psutils.memgraph/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-ldsvc/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-mem/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-io/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-logger/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-display/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-tracelink/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-process/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-net-stack/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-net/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-cobalt/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-crash/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-sysmem/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/system/fidl/fuchsia-camera/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-arm64/sysroot/include",
-            "-I/Users/oscar/Projects/zircon/bootloader/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/clang/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/clang/lib/clang/7.0.0/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/clang/lib/x86_64-fuchsia/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/clang/lib/aarch64-fuchsia/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/gcc/lib/gcc/x86_64-elf/8.1.1/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/gcc/lib/gcc/x86_64-elf/8.1.1/plugin/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/gcc/lib/gcc/x86_64-elf/8.1.1/install-tools/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/gcc/lib/gcc/aarch64-elf/8.1.1/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/gcc/lib/gcc/aarch64-elf/8.1.1/plugin/include",
-            "-I/Users/oscar/Projects/zircon/prebuilt/downloads/gcc/lib/gcc/aarch64-elf/8.1.1/install-tools/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/zx/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/framebuffer/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/chromeos-disk-setup/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fs-host/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/loader-service/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/crypto/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/edid/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/unittest/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/test-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/zxcrypt/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fs-management/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/trace-provider/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/syslog/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/async-testutils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/mini-process/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/trace/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/audio-driver-proto/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/utf_conversion/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/memfs/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/virtio/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fit/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/gpt/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/hwreg/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/inspector/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/vmo-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/trace-engine/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/bitmap/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/driver/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fbl/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/ldmsg/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/blktest/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/ddk/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/digest/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/bootdata/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/zircon/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/async/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/smbios/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/dispatcher-pool/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/runtime/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/elfload/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/intel-hda/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fs-test-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fdio/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/tee-client-api/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/mdns/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fzl/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/perftest/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/explicit-memory/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/svc/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/async-loop/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/launchpad/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/tftp/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/block-client/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/trace-reader/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/kvstore/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/driver-info/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/rtc/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/blobfs/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/audio-proto-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/xdc-server-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/hid/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/zxcpp/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/inet6/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/pretty/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fidl/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/sync/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/hid-parser/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/port/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/process-launcher/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fs/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/runtests-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/gfx/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/region-alloc/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/zbi/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/task-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/audio-utils/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/ddktl/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/fvm/include",
-            "-I/Users/oscar/Projects/zircon/system/ulib/minfs/include",
-            "-I/Users/oscar/Projects/zircon/system/core/crashanalyzer/include",
-            "-I/Users/oscar/Projects/zircon/system/host/fidl/include",
-            "-I/Users/oscar/Projects/zircon/system/host/fvm/include",
-            "-I/Users/oscar/Projects/zircon/system/utest/fbl/include",
-            "-I/Users/oscar/Projects/zircon/system/dev/lib/amlogic/include",
-            "-I/Users/oscar/Projects/zircon/system/dev/lib/hi3660/include",
-            "-I/Users/oscar/Projects/zircon/system/dev/lib/imx8m/include",
-            "-I/Users/oscar/Projects/zircon/system/dev/gpio/pl061/include",
-            "-I/Users/oscar/Projects/zircon/system/dev/clk/meson-lib/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/musl/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/musl/third_party/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/ngunwind/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/backtrace/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/jemalloc/test/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/jemalloc/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/cryptolib/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/linenoise/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/chromiumos-platform-ec/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/usb-dwc-regs/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/qrcodegen/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/lz4/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/cksum/include",
-            "-I/Users/oscar/Projects/zircon/third_party/ulib/uboringssl/include",
-            "-I/Users/oscar/Projects/zircon/third_party/lib/acpica/source/include",
-            "-I/Users/oscar/Projects/zircon/third_party/lib/jitterentropy/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/gen/global/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/uapp/psutils.memgraph/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-ldsvc/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-mem/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-io/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-logger/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-display/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-tracelink/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-process/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-net-stack/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-net/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-cobalt/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-crash/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-sysmem/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/system/fidl/fuchsia-camera/gen/include",
-            "-I/Users/oscar/Projects/zircon/build-x64/sysroot/include",
-            "-I/Users/oscar/Projects/zircon/kernel/include",
-            "-I/Users/oscar/Projects/zircon/kernel/platform/pc/include",
-            "-I/Users/oscar/Projects/zircon/kernel/vm/include",
-            "-I/Users/oscar/Projects/zircon/kernel/object/include",
-            "-I/Users/oscar/Projects/zircon/kernel/arch/x86/include",
-            "-I/Users/oscar/Projects/zircon/kernel/arch/x86/page_tables/include",
-            "-I/Users/oscar/Projects/zircon/kernel/arch/arm64/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/libc/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/crypto/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/pci/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/unittest/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/vdso/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/fbl/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/pow2_range_allocator/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/io/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/debuglog/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/oom/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/cbuf/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/watchdog/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/version/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/heap/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/heap/cmpctmalloc/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/memory_limit/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/user_copy/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/code_patching/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/hypervisor/include",
-            "-I/Users/oscar/Projects/zircon/kernel/lib/fixed_point/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/udisplay/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/pdev/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/timer/arm_generic/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/interrupt/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/interrupt/arm_gic/v2/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/interrupt/arm_gic/common/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/interrupt/arm_gic/v3/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/iommu/intel/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/iommu/dummy/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/psci/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/pcie/include",
-            "-I/Users/oscar/Projects/zircon/kernel/dev/hw_rng/include",
-
-            "-include",
-            "/Users/oscar/Projects/zircon/build-x64/config-kernel.h"
+    for(size_t i = 0; i < command.size(); i++) {
+        char c = command[i];
+
+        if(quote == '\'') {
+            if(c == '\'') {
+                quote = 0;
+            }
+            else {
+                current += c;
+            }
+        }
+        else if(c == '\\' && i + 1 < command.size() && (quote == 0 || command[i + 1] == '"' || command[i + 1] == '\\')) {
+            current += command[++i];
+            inArg = true;
+        }
+        else if(quote == '"') {
+            if(c == '"') {
+                quote = 0;
+            }
+            else {
+                current += c;
+            }
+        }
+        else if(c == '\'' || c == '"') {
+            quote = c;
+            inArg = true;
+        }
+        else if(c == ' ' || c == '\t' || c == '\n') {
+            if(inArg) {
+                args.push_back(current);
+                current.clear();
+                inArg = false;
+            }
+        }
+        else {
+            current += c;
+            inArg = true;
+        }
+    }
+
+    if(inArg) {
+        args.push_back(current);
+    }
+
+    return args;
+}
+
+// Whether arg is -o<path>, naming the output. output is the entry's "output"
+// if it has one; otherwise only clang's -obj... options are told apart.
+bool is_output_argument(const std::string& arg, const std::string& output) {
+    if(arg.size() <= 2 || arg.compare(0, 2, "-o") != 0) {
+        return false;
+    }
+    if(!output.empty()) {
+        return arg.compare(2, std::string::npos, output) == 0;
+    }
+    return arg.compare(0, 4, "-obj") != 0;
+}
+
+std::vector<TranslationUnitJob> read_compile_commands(std::string path, const std::vector<std::string>& extraArgs) {
+    // allow pointing at the build directory, like clang tools' -p
+    std::ifstream in(path + "/compile_commands.json");
+    if(in) {
+        path += "/compile_commands.json";
+    }
+    else {
+        in.open(path);
+    }
+    if(!in) {
+        throw std::runtime_error("failed to open compilation database: " + path);
+    }
+
+    json database = json::parse(in);
+    if(!database.is_array()) {
+        throw std::runtime_error("compilation database is not an array: " + path);
+    }
+
+    std::vector<TranslationUnitJob> jobs;
+    jobs.reserve(database.size());
+
+    for(auto& entry : database) {
+        TranslationUnitJob job;
+        job.directory = entry.value("directory", "");
+
+        auto file = entry.at("file").get<std::string>();
+        if(file.empty() || file[0] == '/' || job.directory.empty()) {
+            job.fileName = file;
+        }
+        else {
+            job.fileName = job.directory + "/" + file;
+        }
+
+        std::vector<std::string> command;
+        if(entry.count("arguments")) {
+            command = entry["arguments"].get<std::vector<std::string>>();
+        }
+        else {
+            command = split_command(entry.at("command").get<std::string>());
+        }
+
+        // drop the compiler itself, the output and the source file; libclang
+        // is given the (absolute) source separately
+        auto output = entry.value("output", "");
+        for(size_t i = 1; i < command.size(); i++) {
+            auto& arg = command[i];
+            if(arg == "-o" && i + 1 < command.size()) {
+                i++;
+                continue;
+            }
+            if(is_output_argument(arg, output) || arg == file || arg == job.fileName) {
+                continue;
+            }
+            job.args.push_back(arg);
+        }
+
+        job.args.insert(job.args.end(), extraArgs.begin(), extraArgs.end());
+        jobs.push_back(std::move(job));
+    }
+
+    return jobs;
+}
+
+// Key for everything about a job that changes its output besides file contents.
+std::string job_identity(const TranslationUnitJob& job) {
+    std::string identity = job.directory + '\n' + job.fileName;
+    for(auto& arg : job.args) {
+        identity += '\n';
+        identity += arg;
+    }
+    return identity;
+}
+
+// How a job is named in --stats and --trace.
+std::string job_name(const TranslationUnitJob& job) {
+    if(!job.fileName.empty() || job.args.empty()) {
+        return job.fileName;
+    }
+    return job.args.back();
+}
+
+// The source file a job parses, resolved against its directory: fileName,
+// or else the last argument that names a regular file. Empty if there is none.
+std::string job_source(const TranslationUnitJob& job) {
+    auto resolve = [&job](const std::string& path) {
+        if(job.directory.empty() || path.empty() || path[0] == '/') {
+            return path;
+        }
+        return job.directory + "/" + path;
     };
 
-    CXTranslationUnit unit;
-    CXErrorCode err = clang_parseTranslationUnit2(
+    if(!job.fileName.empty()) {
+        return resolve(job.fileName);
+    }
+
+    for(auto arg = job.args.rbegin(); arg != job.args.rend(); ++arg) {
+        if(arg->empty() || (*arg)[0] == '-') {
+            continue;
+        }
+
+        auto path = resolve(*arg);
+        struct stat st;
+        if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            return path;
+        }
+    }
+    return std::string();
+}
+
+void inclusion_visitor(CXFile includedFile, CXSourceLocation *, unsigned, CXClientData client_data) {
+    auto files = static_cast<std::vector<std::string>*>(client_data);
+    ManagedCXString fileName(clang_getFileName(includedFile));
+    auto cstr = clang_getCString(fileName);
+    if(cstr != nullptr) {
+        files->push_back(cstr);
+    }
+}
+
+// argv for libclang. workingDirectory holds the -working-directory flag's
+// storage, so it has to outlive the result.
+std::vector<const char *> clang_arguments(const TranslationUnitJob& job, std::string& workingDirectory) {
+    if(!job.directory.empty()) {
+        workingDirectory = "-working-directory=" + job.directory;
+    }
+
+    std::vector<const char *> args;
+    args.reserve(job.args.size() + 1);
+    for(auto& arg : job.args) {
+        args.push_back(arg.c_str());
+    }
+    if(!workingDirectory.empty()) {
+        args.push_back(workingDirectory.c_str());
+    }
+    return args;
+}
+
+// CXTranslationUnit flags every parse starts from.
+const unsigned defaultParseFlags = CXTranslationUnit_DetailedPreprocessingRecord | CXTranslationUnit_KeepGoing;
+
+CXErrorCode parse_translation_unit(CXIndex index, const TranslationUnitJob& job, CXTranslationUnit *unit,
+                                   unsigned flags = defaultParseFlags) {
+    std::string workingDirectory;
+    auto args = clang_arguments(job, workingDirectory);
+
+    return clang_parseTranslationUnit2(
             index,
-            //argv[1],
-            //pargs, 186 + 2,
-            nullptr,
-            reinterpret_cast<const char *const *>(argv + 1), argc - 1,
+            job.fileName.empty() ? nullptr : job.fileName.c_str(),
+            args.data(), static_cast<int>(args.size()),
             nullptr, 0,
-            CXTranslationUnit_DetailedPreprocessingRecord | CXTranslationUnit_KeepGoing,
-            &unit);
+            flags,
+            unit);
+}
+
+// Every file the TU read, main file included.
+std::vector<std::string> get_inclusions(CXTranslationUnit unit, const TranslationUnitJob& job) {
+    std::vector<std::string> inclusions;
+    clang_getInclusions(unit, inclusion_visitor, &inclusions);
+
+    // names are as clang opened them, i.e. relative to -working-directory
+    for(auto& file : inclusions) {
+        if(!job.directory.empty() && !file.empty() && file[0] != '/') {
+            file = job.directory + "/" + file;
+        }
+    }
+
+    return inclusions;
+}
+
+// Loads the TU from astCache if its saved AST is still current, otherwise
+// parses it and saves the result for next time.
+CXErrorCode load_translation_unit(CXIndex index, const TranslationUnitJob& job, IndexCache& astCache,
+                                  CXTranslationUnit *unit, unsigned flags = defaultParseFlags) {
+    auto identity = job_identity(job);
+    if(flags != defaultParseFlags) {
+        identity += "\nflags=" + std::to_string(flags);
+    }
+    auto path = astCache.entry_path(identity);
 
+    if(astCache.is_fresh(identity) && clang_createTranslationUnit2(index, path.c_str(), unit) == CXError_Success) {
+        return CXError_Success;
+    }
+
+    auto err = parse_translation_unit(index, job, unit, flags);
     if(err != CXError_Success) {
-        std::ostringstream out;
-        out << "failed to create parse translation unit. err: ";
-        out << err;
-        throw std::runtime_error(out.str());
+        return err;
     }
 
-    json j;
+    astCache.remove_manifest(identity);
+    auto tmp = path + ".tmp";
+    if(clang_saveTranslationUnit(*unit, tmp.c_str(), clang_defaultSaveOptions(*unit)) == CXSaveError_None &&
+       std::rename(tmp.c_str(), path.c_str()) == 0) {
+        astCache.write_manifest(identity, get_inclusions(*unit, job));
+    }
+    else {
+        std::remove(tmp.c_str());
+    }
+
+    return CXError_Success;
+}
+
+void visit_translation_unit(CXTranslationUnit unit, RecordSink& sink, const VisitOptions& options) {
+    VisitContext context;
+    context.sink = &sink;
+    context.options = &options;
 
     CXCursor cursor = clang_getTranslationUnitCursor(unit);
     clang_visitChildren(
             cursor,
             cursor_visitor,
-            &j);
+            &context);
+}
+
+struct IndexRun {
+    std::vector<TranslationUnitJob> jobs;
+    std::atomic<size_t> next{0};
+    std::vector<CXErrorCode> errors;
+
+    OutputFormat format = OutputFormat::Json;
+    // per-TU records for the json array output and the daemon, in job order
+    std::vector<RecordStore> results;
+    // shared destination for the streaming formats
+    OutputStream *output = nullptr;
+    // set when records refer to strings by id
+    StringTables *tables = nullptr;
+    // collects the tag lines for --format ctags and etags
+    ExternalSorter *tags = nullptr;
+    IndexCache *cache = nullptr;
+    IndexCache *astCache = nullptr;
+    UsrIndexBuilder *usrIndex = nullptr;
+    XrefGraphBuilder *xrefGraph = nullptr;
+    TrigramIndexBuilder *trigramIndex = nullptr;
+
+    // what is written out; visitOptions.fields adds whatever the indexes need
+    uint32_t fields = RecordField_All;
+    VisitOptions visitOptions;
+    // CXTranslationUnit flags for every parse
+    unsigned parseFlags = defaultParseFlags;
+    Engine engine = Engine::Visit;
+    uint64_t memoryBudget = 0;
+    OverBudget overBudget = OverBudget::Degrade;
+
+    // --stats for each job, in job order; empty unless asked for
+    std::vector<TranslationUnitStats> stats;
+    Tracer *tracer = nullptr;
+};
+
+// The memory libclang holds for unit, in bytes. If usage is set, it receives
+// the amounts by category.
+uint64_t translation_unit_memory(CXTranslationUnit unit, std::map<std::string, uint64_t> *usage = nullptr) {
+    auto resources = clang_getCXTUResourceUsage(unit);
+
+    uint64_t total = 0;
+    for(unsigned i = 0; i < resources.numEntries; i++) {
+        auto& entry = resources.entries[i];
+        if(entry.kind < CXTUResourceUsage_MEMORY_IN_BYTES_BEGIN || entry.kind > CXTUResourceUsage_MEMORY_IN_BYTES_END) {
+            continue;
+        }
+
+        total += entry.amount;
+        if(usage) {
+            (*usage)[clang_getTUResourceUsageName(entry.kind)] = entry.amount;
+        }
+    }
+
+    clang_disposeCXTUResourceUsage(resources);
+    return total;
+}
+
+// If inclusions is set, it receives every file the TU read. With
+// run.memoryBudget, stats must be set; it tells whether the TU was over.
+CXErrorCode index_translation_unit(CXIndex index, const IndexRun& run, const TranslationUnitJob& job, RecordSink& sink,
+                                   std::vector<std::string> *inclusions = nullptr,
+                                   TranslationUnitStats *stats = nullptr) {
+    CXTranslationUnit unit;
+    CXErrorCode err;
+    {
+        TraceSpan span(run.tracer, "parse");
+        PhaseTimer timer(stats, TranslationUnitStats::Parse);
+        err = run.astCache
+                ? load_translation_unit(index, job, *run.astCache, &unit, run.parseFlags)
+                : parse_translation_unit(index, job, &unit, run.parseFlags);
+    }
+
+    if(err != CXError_Success) {
+        return err;
+    }
+
+    // the budget can only be checked once the memory is spent, but at least
+    // the records, which on top of that grow with the AST, are not
+    if(stats) {
+        auto memory = translation_unit_memory(unit, &stats->clangMemory);
+        if(run.memoryBudget && memory > run.memoryBudget) {
+            clang_disposeTranslationUnit(unit);
+
+            if(run.overBudget == OverBudget::Degrade) {
+                auto flags = (run.parseFlags | CXTranslationUnit_SkipFunctionBodies) &
+                             ~CXTranslationUnit_DetailedPreprocessingRecord;
+                {
+                    TraceSpan span(run.tracer, "parse", { { "degraded", true } });
+                    PhaseTimer timer(stats, TranslationUnitStats::Parse);
+                    err = run.astCache
+                            ? load_translation_unit(index, job, *run.astCache, &unit, flags)
+                            : parse_translation_unit(index, job, &unit, flags);
+                }
+                if(err != CXError_Success) {
+                    return err;
+                }
+
+                stats->degraded = true;
+                stats->clangMemory.clear();
+                if(translation_unit_memory(unit, &stats->clangMemory) > run.memoryBudget) {
+                    clang_disposeTranslationUnit(unit);
+                    stats->overBudget = true;
+                    return CXError_Failure;
+                }
+            }
+            else {
+                stats->overBudget = true;
+                return CXError_Failure;
+            }
+        }
+    }
+
+    {
+        TraceSpan span(run.tracer, "visit");
+        PhaseTimer timer(stats, TranslationUnitStats::Visit);
+        visit_translation_unit(unit, sink, run.visitOptions);
+    }
+
+    if(inclusions) {
+        *inclusions = get_inclusions(unit, job);
+    }
 
     clang_disposeTranslationUnit(unit);
+
+    return CXError_Success;
+}
+
+// The Engine::Index counterpart of index_translation_unit. Every job a worker
+// indexes shares its action, which is the session
+// CXIndexOpt_SkipParsedBodiesInSession skips headers across. That makes a
+// TU's records depend on what the worker indexed before it, so with a cache,
+// which stores them per TU, every TU is indexed in full.
+CXErrorCode index_source_file(CXIndexAction action, const IndexRun& run, const TranslationUnitJob& job,
+                              RecordSink& sink, std::vector<std::string> *inclusions = nullptr,
+                              TranslationUnitStats *stats = nullptr) {
+    std::string workingDirectory;
+    auto args = clang_arguments(job, workingDirectory);
+
+    IndexerCallbacks callbacks = {};
+    callbacks.indexDeclaration = index_declaration;
+    callbacks.indexEntityReference = index_entity_reference;
+
+    unsigned indexOptions = CXIndexOpt_SuppressWarnings;
+    if(!run.cache) {
+        indexOptions |= CXIndexOpt_SkipParsedBodiesInSession;
+    }
+    if(!run.visitOptions.declarationsOnly) {
+        // parameters and locals, which cursor_visitor reports as well
+        indexOptions |= CXIndexOpt_IndexFunctionLocalSymbols;
+    }
+
+    VisitContext context;
+    context.sink = &sink;
+    context.options = &run.visitOptions;
+
+    // the TU is only kept when its inclusions or its memory are needed
+    CXTranslationUnit unit = nullptr;
+    // parsing and the callbacks are interleaved, so both count as parsing
+    TraceSpan span(run.tracer, "index");
+    PhaseTimer timer(stats, TranslationUnitStats::Parse);
+    auto err = clang_indexSourceFile(
+            action, &context, &callbacks, sizeof(callbacks), indexOptions,
+            job.fileName.empty() ? nullptr : job.fileName.c_str(),
+            args.data(), static_cast<int>(args.size()),
+            nullptr, 0,
+            inclusions || stats ? &unit : nullptr,
+            run.parseFlags);
+
+    if(err != 0) {
+        return static_cast<CXErrorCode>(err);
+    }
+
+    if(unit) {
+        if(inclusions) {
+            *inclusions = get_inclusions(unit, job);
+        }
+        if(stats) {
+            translation_unit_memory(unit, &stats->clangMemory);
+        }
+        clang_disposeTranslationUnit(unit);
+    }
+
+    return CXError_Success;
+}
+
+// Each worker owns its CXIndex and pulls the next job off a shared counter,
+// so TUs of very different sizes still spread evenly over the threads.
+void index_worker(IndexRun& run) {
+    auto index = clang_createIndex(false, 0);
+    auto action = run.engine == Engine::Index ? clang_IndexAction_create(index) : nullptr;
+
+    auto index_job = [&](const TranslationUnitJob& job, RecordSink& sink, std::vector<std::string> *inclusions,
+                         TranslationUnitStats *stats) {
+        return action
+                ? index_source_file(action, run, job, sink, inclusions, stats)
+                : index_translation_unit(index, run, job, sink, inclusions, stats);
+    };
+
+    std::unique_ptr<StreamingSink> stream;
+    std::unique_ptr<TagSink> tags;
+    if(run.tags) {
+        tags.reset(new TagSink(*run.tags, run.format));
+    }
+    else if(run.format != OutputFormat::Json) {
+        stream.reset(new StreamingSink(*run.output, run.format, run.tables, run.fields));
+    }
+
+    UsrIndexBuilder usrIndex;
+    XrefGraphBuilder xrefGraph;
+    TrigramIndexBuilder trigramIndex;
+
+    for(size_t i = run.next++; i < run.jobs.size(); i = run.next++) {
+        std::unique_ptr<RecordStoreSink> store;
+        RecordSink *sink = stream ? static_cast<RecordSink*>(stream.get()) : tags.get();
+        if(!sink) {
+            store.reset(new RecordStoreSink(run.results[i]));
+            sink = store.get();
+        }
+
+        std::unique_ptr<CollectingSink<UsrIndexBuilder>> usrIndexSink;
+        if(run.usrIndex) {
+            usrIndexSink.reset(new CollectingSink<UsrIndexBuilder>(usrIndex, *sink));
+            sink = usrIndexSink.get();
+        }
+
+        std::unique_ptr<CollectingSink<XrefGraphBuilder>> xrefGraphSink;
+        if(run.xrefGraph) {
+            xrefGraphSink.reset(new CollectingSink<XrefGraphBuilder>(xrefGraph, *sink));
+            sink = xrefGraphSink.get();
+        }
+
+        std::unique_ptr<CollectingSink<TrigramIndexBuilder>> trigramIndexSink;
+        if(run.trigramIndex) {
+            trigramIndexSink.reset(new CollectingSink<TrigramIndexBuilder>(trigramIndex, *sink));
+            sink = trigramIndexSink.get();
+        }
+
+        auto stats = run.stats.empty() ? nullptr : &run.stats[i];
+        TraceSpan unitSpan(run.tracer, "translation unit", { { "file", job_name(run.jobs[i]) } });
+        std::unique_ptr<CollectingSink<TranslationUnitStats>> statsSink;
+        if(stats) {
+            statsSink.reset(new CollectingSink<TranslationUnitStats>(*stats, *sink));
+            sink = statsSink.get();
+        }
+        if(stream) {
+            stream->set_stats(stats);
+        }
+        if(tags) {
+            tags->set_stats(stats);
+        }
+
+        if(run.cache) {
+            auto identity = job_identity(run.jobs[i]) + visit_identity(run.visitOptions);
+            if(run.engine == Engine::Index) {
+                identity += "\n--engine=index";
+            }
+            bool replayed;
+            {
+                TraceSpan span(run.tracer, "replay");
+                PhaseTimer timer(stats, TranslationUnitStats::Replay);
+                replayed = run.cache->replay(identity, *sink);
+            }
+
+            if(replayed) {
+                if(stats) {
+                    stats->cached = true;
+                }
+            }
+            else {
+                CacheWriter writer(*run.cache, identity, *sink);
+                std::vector<std::string> inclusions;
+                run.errors[i] = index_job(run.jobs[i], writer, &inclusions, stats);
+                // a degraded TU's records are incomplete, so they must not
+                // stand in for the full result on a later run
+                if(run.errors[i] == CXError_Success && !(stats && stats->degraded)) {
+                    writer.commit(inclusions);
+                }
+            }
+        }
+        else {
+            run.errors[i] = index_job(run.jobs[i], *sink, nullptr, stats);
+        }
+        sink->flush();
+
+        if(stats) {
+            if(!run.results.empty()) {
+                stats->recordStoreBytes = run.results[i].memory_usage();
+            }
+            stats->peakRssBytes = peak_rss_bytes();
+        }
+
+        // serializing happens record by record inside the visit, so it is
+        // shown as totals on the TU rather than as spans of its own
+        if(stats && run.tracer) {
+            auto& args = unitSpan.args();
+            args["cached"] = stats->cached;
+            args["cursors"] = stats->cursors;
+            args["output_bytes"] = stats->outputBytes;
+            args["serialize_ms"] = stats->nanoseconds[TranslationUnitStats::Serialize] / 1e6;
+            args["write_ms"] = stats->nanoseconds[TranslationUnitStats::Write] / 1e6;
+        }
+    }
+
+    if(run.usrIndex) {
+        run.usrIndex->merge(usrIndex);
+    }
+    if(run.xrefGraph) {
+        run.xrefGraph->merge(xrefGraph);
+    }
+    if(run.trigramIndex) {
+        run.trigramIndex->merge(trigramIndex);
+    }
+
+    if(action) {
+        clang_IndexAction_dispose(action);
+    }
     clang_disposeIndex(index);
+}
+
+void run_workers(IndexRun& run, unsigned jobs) {
+    auto workerCount = std::min<size_t>(jobs, run.jobs.size());
+    if(workerCount <= 1) {
+        index_worker(run);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < workerCount; i++) {
+        workers.emplace_back(index_worker, std::ref(run));
+    }
+    for(auto& worker : workers) {
+        worker.join();
+    }
+}
+
+struct WatchedUnit {
+    CXTranslationUnit unit = nullptr;
+    // what the TU read on its last parse, with the times we saw then
+    std::vector<std::string> files;
+    std::vector<int64_t> mtimes;
+};
+
+// The times of a TU's files as they were before it was (re)parsed.
+struct MtimeSnapshot {
+    std::unordered_map<std::string, int64_t> mtimes;
+    // wall clock time the snapshot was taken, in nanoseconds
+    int64_t taken = 0;
+};
+
+// Keeps every TU alive with a precompiled preamble and re-emits a TU's records
+// whenever one of the files it read changes. Each TU's records are preceded by
+// a {"translation_unit": name} record; consumers replace what they had for it.
+int run_watch(IndexRun& run, unsigned intervalMs) {
+    auto index = clang_createIndex(false, 0);
+
+    StreamingSink stream(*run.output, run.format, run.tables, run.fields);
+
+    std::vector<WatchedUnit> units(run.jobs.size());
+
+    // the file to watch for a TU that failed to parse
+    std::vector<std::string> sources;
+    for(auto& job : run.jobs) {
+        sources.push_back(job_source(job));
+        if(sources.back().empty()) {
+            throw std::runtime_error("--watch cannot tell which file to watch for: " + job_name(job));
+        }
+    }
+
+    auto snapshot = [&](size_t i) {
+        auto& watched = units[i];
+        MtimeSnapshot before;
+        before.taken = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        for(auto& file : watched.files) {
+            before.mtimes[file] = file_mtime(file);
+        }
+        return before;
+    };
+
+    // What to remember for file. A file that was not read before has no
+    // time from the snapshot; if it was written since, it is remembered as
+    // changed so that the next poll picks the write up.
+    auto seen_mtime = [](const MtimeSnapshot& before, const std::string& file) {
+        auto it = before.mtimes.find(file);
+        if(it != before.mtimes.end()) {
+            return it->second;
+        }
+        auto mtime = file_mtime(file);
+        return mtime >= before.taken ? static_cast<int64_t>(-2) : mtime;
+    };
+
+    auto emit = [&](size_t i, const MtimeSnapshot& before) {
+        auto& watched = units[i];
 
-    std::cout << j.dump(2) << std::endl;
+        ManagedCXString spelling(clang_getTranslationUnitSpelling(watched.unit));
+        json marker;
+        marker["translation_unit"] = spelling;
+        stream.write_value(marker);
 
-    return 0;
-}
\ No newline at end of file
+        visit_translation_unit(watched.unit, stream, run.visitOptions);
+        stream.flush();
+
+        watched.files = get_inclusions(watched.unit, run.jobs[i]);
+        watched.mtimes.clear();
+        for(auto& file : watched.files) {
+            watched.mtimes.push_back(seen_mtime(before, file));
+        }
+    };
+
+    auto parse = [&](size_t i, const MtimeSnapshot& before) {
+        auto& watched = units[i];
+        auto err = parse_translation_unit(index, run.jobs[i], &watched.unit,
+                                          CXTranslationUnit_PrecompiledPreamble |
+                                          CXTranslationUnit_CreatePreambleOnFirstParse | run.parseFlags);
+        if(err != CXError_Success) {
+            std::cerr << job_name(run.jobs[i]) << ": failed to create parse translation unit. err: " << err << std::endl;
+            watched.unit = nullptr;
+
+            // try again once the source itself changes
+            watched.files.assign(1, sources[i]);
+            watched.mtimes.assign(1, seen_mtime(before, sources[i]));
+            return;
+        }
+        emit(i, before);
+    };
+
+    for(size_t i = 0; i < units.size(); i++) {
+        parse(i, snapshot(i));
+    }
+
+    while(true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+
+        for(size_t i = 0; i < units.size(); i++) {
+            auto& watched = units[i];
+
+            bool changed = false;
+            for(size_t f = 0; f < watched.files.size() && !changed; f++) {
+                changed = file_mtime(watched.files[f]) != watched.mtimes[f];
+            }
+            if(!changed) {
+                continue;
+            }
+
+            auto before = snapshot(i);
+            if(watched.unit == nullptr) {
+                parse(i, before);
+            }
+            else if(clang_reparseTranslationUnit(watched.unit, 0, nullptr, clang_defaultReparseOptions(watched.unit)) == 0) {
+                emit(i, before);
+            }
+            else {
+                // a failed reparse leaves the TU unusable
+                clang_disposeTranslationUnit(watched.unit);
+                parse(i, before);
+            }
+        }
+    }
+}
+
+// The per-TU stats followed by their sum, as json.
+void write_stats(const std::string& path, const IndexRun& run, double wallSeconds) {
+    auto kindName = [](unsigned kind) {
+        ManagedCXString name(clang_getCursorKindSpelling(static_cast<CXCursorKind>(kind)));
+        json spelling = name;
+        return spelling.is_string() ? spelling.get<std::string>() : std::to_string(kind);
+    };
+
+    TranslationUnitStats total;
+    size_t cached = 0;
+    size_t degraded = 0;
+    size_t overBudget = 0;
+    size_t failed = 0;
+    json units = json::array();
+
+    for(size_t i = 0; i < run.jobs.size(); i++) {
+        auto& stats = run.stats[i];
+
+        auto unit = stats.to_json(kindName);
+        unit["file"] = job_name(run.jobs[i]);
+        unit["error"] = run.errors[i];
+        unit["cached"] = stats.cached;
+        if(run.memoryBudget) {
+            unit["degraded"] = stats.degraded;
+            unit["over_budget"] = stats.overBudget;
+        }
+        units.push_back(std::move(unit));
+
+        total.merge(stats);
+        cached += stats.cached;
+        degraded += stats.degraded;
+        overBudget += stats.overBudget;
+        failed += run.errors[i] != CXError_Success;
+    }
+
+    json j;
+    j["translation_units"] = std::move(units);
+    auto& summary = j["total"] = total.to_json(kindName);
+    summary["wall_seconds"] = wallSeconds;
+    summary["translation_units"] = run.jobs.size();
+    summary["cached"] = cached;
+    summary["failed"] = failed;
+    if(run.memoryBudget) {
+        summary["memory_budget_bytes"] = run.memoryBudget;
+        summary["degraded"] = degraded;
+        summary["over_budget"] = overBudget;
+    }
+    // the whole run's, which the TUs' only show up to their end
+    summary["memory_bytes"]["process_peak_rss"] = peak_rss_bytes();
+
+    if(path == "-") {
+        std::cerr << j.dump(2) << std::endl;
+        return;
+    }
+
+    std::ofstream out(path);
+    out << j.dump(2) << std::endl;
+    if(!out) {
+        throw std::runtime_error("failed to write stats: " + path);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        throw std::runtime_error("argc < 2");
+    }
+
+    auto options = parse_options(argc, argv);
+
+    if(options.lookupUsr) {
+        UsrIndex index(options.usrIndexFile);
+        for(auto& usr : options.clangArgs) {
+            auto slot = index.find(usr);
+            std::cout << (slot ? index.to_json(*slot) : json(nullptr)).dump() << std::endl;
+        }
+        return 0;
+    }
+
+    if(options.lookupReferences) {
+        XrefGraph graph(options.xrefGraphFile);
+        for(auto& usr : options.clangArgs) {
+            auto edges = graph.find(usr);
+            json references = nullptr;
+            if(edges.first) {
+                references = json::array();
+                for(auto edge = edges.first; edge != edges.second; ++edge) {
+                    references.push_back(graph.to_json(*edge));
+                }
+            }
+            std::cout << references.dump() << std::endl;
+        }
+        return 0;
+    }
+
+    if(options.search) {
+        TrigramIndex index(options.trigramIndexFile);
+        for(auto& query : options.clangArgs) {
+            auto documents = options.fuzzy
+                    ? index.fuzzy_search(query, options.searchLimit)
+                    : index.search(query, options.searchLimit);
+
+            json results = json::array();
+            for(auto document : documents) {
+                results.push_back(index.to_json(document));
+            }
+            std::cout << results.dump() << std::endl;
+        }
+        return 0;
+    }
+
+    IndexRun run;
+    if(!options.compileCommands.empty()) {
+        run.jobs = read_compile_commands(options.compileCommands, options.clangArgs);
+    }
+    else if(!options.batchFile.empty()) {
+        run.jobs = read_batch_file(options.batchFile, options.clangArgs);
+    }
+    else {
+        TranslationUnitJob job;
+        job.args = options.clangArgs;
+        run.jobs.push_back(std::move(job));
+    }
+
+    StringTables tables;
+    OutputStream output(std::cout, options.format, options.intern ? &tables : nullptr);
+    run.format = options.format;
+    run.output = &output;
+    if(options.intern) {
+        run.tables = &tables;
+    }
+
+    std::unique_ptr<IndexCache> cache;
+    if(!options.cacheDirectory.empty()) {
+        cache.reset(new IndexCache(options.cacheDirectory, "records"));
+        run.cache = cache.get();
+    }
+
+    std::unique_ptr<IndexCache> astCache;
+    if(!options.astCacheDirectory.empty()) {
+        astCache.reset(new IndexCache(options.astCacheDirectory, "ast"));
+        run.astCache = astCache.get();
+    }
+
+    if(options.fields) {
+        run.fields = options.fields;
+        run.visitOptions.fields = options.fields;
+    }
+
+    if(options.declarationsOnly) {
+        run.visitOptions.declarationsOnly = true;
+        // bodies are never visited, so there is no point in parsing them
+        run.parseFlags |= CXTranslationUnit_SkipFunctionBodies;
+    }
+
+    run.engine = options.engine;
+    if(run.engine == Engine::Index && (options.watch || !options.astCacheDirectory.empty())) {
+        // the indexer parses on its own, with neither saved ASTs nor reparsing
+        throw std::runtime_error("--engine index cannot be combined with --watch or --ast-cache");
+    }
+
+    run.memoryBudget = options.memoryBudget;
+    run.overBudget = options.overBudget;
+    if(run.memoryBudget && (run.engine == Engine::Index || options.watch)) {
+        // neither has a parsed TU to check before its records are out
+        throw std::runtime_error("--memory-budget cannot be combined with --engine index or --watch");
+    }
+
+    run.visitOptions.mainFileOnly = options.mainFileOnly;
+    run.visitOptions.skipSystemHeaders = options.skipSystemHeaders;
+    run.visitOptions.pathPrefixes = options.projectPrefixes;
+
+    UsrIndexBuilder usrIndex;
+    if(!options.usrIndexFile.empty()) {
+        run.usrIndex = &usrIndex;
+        run.visitOptions.fields |= RecordField_Location | RecordField_IsDefinition | RecordField_Usr;
+    }
+
+    XrefGraphBuilder xrefGraph;
+    if(!options.xrefGraphFile.empty()) {
+        run.xrefGraph = &xrefGraph;
+        run.visitOptions.fields |= RecordField_Location | RecordField_IsDefinition | RecordField_Usr |
+                                   RecordField_ReferencedUsr;
+    }
+
+    TrigramIndexBuilder trigramIndex;
+    if(!options.trigramIndexFile.empty()) {
+        run.trigramIndex = &trigramIndex;
+        run.visitOptions.fields |= RecordField_Location | RecordField_Spelling | RecordField_Display |
+                                   RecordField_IsDefinition | RecordField_Usr | RecordField_QualifiedName;
+    }
+
+    if(options.watch) {
+        if(run.format == OutputFormat::Json || run.format == OutputFormat::Ctags || run.format == OutputFormat::Etags) {
+            throw std::runtime_error("--watch needs a streaming --format");
+        }
+        if(!options.statsFile.empty() || !options.traceFile.empty()) {
+            throw std::runtime_error("--stats and --trace cannot be combined with --watch");
+        }
+        return run_watch(run, options.watchInterval);
+    }
+
+    if(!options.daemonSocket.empty()) {
+        // the daemon keeps plain records, whatever the output options say
+        run.format = OutputFormat::Json;
+        run.tables = nullptr;
+        run.fields = RecordField_All;
+        run.visitOptions.fields |= RecordField_All & ~RecordField_QualifiedName;
+    }
+
+    std::unique_ptr<ExternalSorter> tags;
+    if(run.format == OutputFormat::Ctags || run.format == OutputFormat::Etags) {
+        if(options.intern) {
+            throw std::runtime_error("--intern cannot be combined with --format ctags or etags");
+        }
+
+        // tags are only made from declarations and macros
+        run.visitOptions.declarationsOnly = true;
+        run.visitOptions.macroDefinitions = true;
+        run.visitOptions.fields |= tagRecordFields;
+        run.parseFlags |= CXTranslationUnit_SkipFunctionBodies;
+
+        // every worker sorts in its share of the memory
+        tags.reset(new ExternalSorter(std::max<uint64_t>(options.sortMemory / options.jobs, 1)));
+        run.tags = tags.get();
+    }
+
+    run.errors.assign(run.jobs.size(), CXError_Success);
+    if(run.format == OutputFormat::Json) {
+        run.results.resize(run.jobs.size());
+    }
+
+    std::unique_ptr<Tracer> tracer;
+    if(!options.traceFile.empty()) {
+        tracer.reset(new Tracer());
+        run.tracer = tracer.get();
+    }
+
+    // the trace shows some of the stats on its spans, and the memory budget
+    // is checked against them
+    if(!options.statsFile.empty() || tracer || run.memoryBudget) {
+        run.stats.resize(run.jobs.size());
+    }
+
+    if(options.perfCounters) {
+        if(options.statsFile.empty()) {
+            throw std::runtime_error("--perf-counters needs --stats");
+        }
+
+        // the workers' counters open the same way, so one probe tells for all
+        auto& counters = PerfCounters::for_this_thread();
+        if(counters.mask()) {
+            for(auto& stats : run.stats) {
+                stats.countHardware = true;
+            }
+        }
+        else {
+            std::cerr << "hardware counters unavailable, leaving them out of --stats: " << counters.error() << std::endl;
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    auto write_reports = [&]() {
+        if(!options.statsFile.empty()) {
+            write_stats(options.statsFile, run, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        if(tracer) {
+            tracer->write(options.traceFile);
+        }
+    };
+
+    run_workers(run, options.jobs);
+
+    if(run.usrIndex) {
+        usrIndex.write(options.usrIndexFile);
+    }
+    if(run.xrefGraph) {
+        xrefGraph.write(options.xrefGraphFile);
+    }
+    if(run.trigramIndex) {
+        trigramIndex.write(options.trigramIndexFile);
+    }
+
+    int status = 0;
+    // the jobs whose records go into the json array
+    std::vector<size_t> succeeded;
+
+    for(size_t i = 0; i < run.jobs.size(); i++) {
+        if(run.errors[i] != CXError_Success) {
+            std::ostringstream out;
+            if(!run.stats.empty() && run.stats[i].overBudget) {
+                out << "skipped, libclang needed " << run.stats[i].total_clang_memory()
+                    << " bytes with a --memory-budget of " << run.memoryBudget;
+            }
+            else {
+                out << "failed to create parse translation unit. err: ";
+                out << run.errors[i];
+            }
+
+            if(options.batchFile.empty() && options.compileCommands.empty()) {
+                throw std::runtime_error(out.str());
+            }
+
+            std::cerr << run.jobs[i].fileName << ": " << out.str() << std::endl;
+            status = 1;
+            continue;
+        }
+
+        if(run.format == OutputFormat::Json) {
+            succeeded.push_back(i);
+        }
+    }
+
+    if(!options.daemonSocket.empty()) {
+        SymbolIndex index;
+        Record record;
+        for(auto& store : run.results) {
+            for(size_t row = 0; row < store.size(); row++) {
+                store.get(row, record);
+                index.add(record);
+            }
+            store = RecordStore();
+        }
+        index.finalize();
+
+        write_reports();
+
+        std::cerr << "serving " << index.size() << " records on " << options.daemonSocket << std::endl;
+        serve_unix_socket(options.daemonSocket, index);
+    }
+    else if(run.tags) {
+        TraceSpan span(run.tracer, "merge tags");
+        if(run.format == OutputFormat::Etags) {
+            write_etags(*tags, std::cout);
+        }
+        else {
+            write_ctags(*tags, std::cout);
+        }
+        std::cout.flush();
+    }
+    else if(run.format == OutputFormat::Json) {
+        RecordEncoder encoder(run.tables, run.fields);
+        auto write_records = [&](unsigned indent) {
+            JsonArrayWriter writer(std::cout, encoder, indent);
+            for(auto i : succeeded) {
+                TraceSpan span(run.tracer, "serialize", { { "file", job_name(run.jobs[i]) } });
+                writer.write(run.results[i], run.stats.empty() ? nullptr : &run.stats[i]);
+            }
+            writer.finish();
+        };
+
+        if(run.tables) {
+            // same layout as dump(2) of {"records": [...], "strings": {...}}
+            std::cout << "{\n  \"records\": ";
+            write_records(2);
+
+            auto strings = tables.to_json().dump(2);
+            for(size_t newline = strings.find('\n'); newline != std::string::npos; newline = strings.find('\n', newline + 3)) {
+                strings.replace(newline, 1, "\n  ");
+            }
+            std::cout << ",\n  \"strings\": " << strings << "\n}" << std::endl;
+        }
+        else {
+            write_records(0);
+            std::cout << std::endl;
+        }
+    }
+
+    write_reports();
+
+    return status;
+}
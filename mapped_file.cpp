@@ -0,0 +1,44 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        throw std::runtime_error("failed to open " + path);
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("failed to stat " + path);
+    }
+
+    length = static_cast<size_t>(st.st_size);
+    if(length == 0) {
+        close(fd);
+        return;
+    }
+
+    auto result = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(result == MAP_FAILED) {
+        throw std::runtime_error("failed to map " + path);
+    }
+    mapping = static_cast<const char *>(result);
+}
+
+bool MappedFile::fits(uint64_t offset, uint64_t count, size_t elementSize) const {
+    // no multiplication that could overflow
+    return offset <= length && count <= (length - offset) / elementSize;
+}
+
+MappedFile::~MappedFile() {
+    if(mapping) {
+        munmap(const_cast<char *>(mapping), length);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A whole file mapped read-only into memory.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char *data() const { return mapping; }
+    size_t size() const { return length; }
+    // Whether count elements of elementSize bytes starting at offset lie
+    // within the file, for checking the sections a header points to.
+    bool fits(uint64_t offset, uint64_t count, size_t elementSize) const;
+
+private:
+    const char *mapping = nullptr;
+    size_t length = 0;
+};
@@ -0,0 +1,347 @@
+#include "output.h"
+
+#include <cstdint>
+#include <cstring>
+
+OutputFormat parse_output_format(const std::string& name) {
+    if(name == "json") {
+        return OutputFormat::Json;
+    }
+    else if(name == "ndjson") {
+        return OutputFormat::Ndjson;
+    }
+    else if(name == "cbor") {
+        return OutputFormat::Cbor;
+    }
+    else if(name == "msgpack") {
+        return OutputFormat::MessagePack;
+    }
+    else if(name == "ubjson") {
+        return OutputFormat::Ubjson;
+    }
+    else if(name == "bson") {
+        return OutputFormat::Bson;
+    }
+    else if(name == "ctags") {
+        return OutputFormat::Ctags;
+    }
+    else if(name == "etags") {
+        return OutputFormat::Etags;
+    }
+
+    throw std::runtime_error("unknown output format: " + name);
+}
+
+namespace {
+
+template<typename T>
+void append_little_endian(std::string& out, T value) {
+    for(size_t i = 0; i < sizeof(T); i++) {
+        out += static_cast<char>((static_cast<uint64_t>(value) >> (i * 8)) & 0xff);
+    }
+}
+
+template<typename Json>
+void append_bson_element(const std::string& name, const Json& value, std::string& out);
+
+template<typename Json>
+void append_bson_document(const Json& value, std::string& out) {
+    auto start = out.size();
+    append_little_endian<int32_t>(out, 0);
+
+    if(value.is_array()) {
+        size_t i = 0;
+        for(auto& element : value) {
+            append_bson_element(std::to_string(i++), element, out);
+        }
+    }
+    else {
+        for(auto it = value.begin(); it != value.end(); ++it) {
+            append_bson_element(it.key(), it.value(), out);
+        }
+    }
+
+    out += '\0';
+
+    // patch in the final size now that it is known
+    std::string size;
+    append_little_endian<int32_t>(size, static_cast<int32_t>(out.size() - start));
+    out.replace(start, size.size(), size);
+}
+
+template<typename Json>
+void append_bson_element(const std::string& name, const Json& value, std::string& out) {
+    auto type = out.size();
+    out += '\0';
+    out += name;
+    out += '\0';
+
+    switch(value.type()) {
+        case Json::value_t::null:
+            out[type] = 0x0a;
+            break;
+        case Json::value_t::boolean:
+            out[type] = 0x08;
+            out += static_cast<char>(value.template get<bool>() ? 1 : 0);
+            break;
+        case Json::value_t::number_integer:
+        case Json::value_t::number_unsigned: {
+            auto number = value.template get<int64_t>();
+            if(number >= INT32_MIN && number <= INT32_MAX) {
+                out[type] = 0x10;
+                append_little_endian<int32_t>(out, static_cast<int32_t>(number));
+            }
+            else {
+                out[type] = 0x12;
+                append_little_endian<int64_t>(out, number);
+            }
+            break;
+        }
+        case Json::value_t::number_float: {
+            out[type] = 0x01;
+            auto number = value.template get<double>();
+            uint64_t bits;
+            std::memcpy(&bits, &number, sizeof(bits));
+            append_little_endian<uint64_t>(out, bits);
+            break;
+        }
+        case Json::value_t::string: {
+            out[type] = 0x02;
+            auto& str = value.template get_ref<const std::string&>();
+            append_little_endian<int32_t>(out, static_cast<int32_t>(str.size() + 1));
+            out += str;
+            out += '\0';
+            break;
+        }
+        case Json::value_t::object:
+            out[type] = 0x03;
+            append_bson_document(value, out);
+            break;
+        case Json::value_t::array:
+            out[type] = 0x04;
+            append_bson_document(value, out);
+            break;
+        default:
+            throw std::runtime_error("value cannot be encoded as BSON");
+    }
+}
+
+}
+
+template<typename Json>
+void append_bson(const Json& record, std::string& out) {
+    if(!record.is_object()) {
+        throw std::runtime_error("BSON top-level value must be an object");
+    }
+    append_bson_document(record, out);
+}
+
+template<typename Json>
+void encode_record(const Json& record, OutputFormat format, std::string& out) {
+    switch(format) {
+        case OutputFormat::Cbor:
+            Json::to_cbor(record, out);
+            break;
+        case OutputFormat::MessagePack:
+            Json::to_msgpack(record, out);
+            break;
+        case OutputFormat::Ubjson:
+            Json::to_ubjson(record, out);
+            break;
+        case OutputFormat::Bson:
+            append_bson(record, out);
+            break;
+        default:
+            out += record.dump();
+            out += '\n';
+            break;
+    }
+}
+
+template void append_bson(const json& record, std::string& out);
+template void append_bson(const RecordJson& record, std::string& out);
+template void encode_record(const json& record, OutputFormat format, std::string& out);
+template void encode_record(const RecordJson& record, OutputFormat format, std::string& out);
+
+size_t StringTable::intern(const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = ids.find(value);
+    if(it != ids.end()) {
+        return it->second;
+    }
+
+    auto id = values.size();
+    values.push_back(value);
+    ids.emplace(value, id);
+    return id;
+}
+
+size_t StringTable::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return values.size();
+}
+
+std::string StringTable::at(size_t id) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return values.at(id);
+}
+
+json StringTables::to_json() const {
+    json j;
+    for(auto& table : { std::make_pair("files", &files), std::make_pair("kinds", &kinds),
+                        std::make_pair("types", &types), std::make_pair("languages", &languages) }) {
+        auto& values = j[table.first] = json::array();
+        for(size_t id = 0, size = table.second->size(); id < size; id++) {
+            values.push_back(table.second->at(id));
+        }
+    }
+    return j;
+}
+
+void OutputStream::write_string_definitions(const char *name, const StringTable& table, size_t& written) {
+    std::string definitions;
+    for(auto size = table.size(); written < size; written++) {
+        json definition;
+        definition["string"] = { { "table", name }, { "id", written }, { "value", table.at(written) } };
+        encode_record(definition, format, definitions);
+    }
+    out.write(definitions.data(), static_cast<std::streamsize>(definitions.size()));
+}
+
+void OutputStream::write(const std::string& chunk) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // every id used in chunk was handed out before we got here, so writing
+    // the tables up to their current size covers all of them
+    if(tables) {
+        write_string_definitions("files", tables->files, filesWritten);
+        write_string_definitions("kinds", tables->kinds, kindsWritten);
+        write_string_definitions("types", tables->types, typesWritten);
+        write_string_definitions("languages", tables->languages, languagesWritten);
+    }
+
+    out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+    // let consumers start on the output while we are still parsing
+    out.flush();
+}
+
+size_t RecordEncoder::intern(const std::string& value, StringTable& table, Cache& cache) {
+    auto it = cache.find(value);
+    if(it == cache.end()) {
+        it = cache.emplace(value, table.intern(value)).first;
+    }
+    return it->second;
+}
+
+RecordJson RecordEncoder::to_json(const Record& record) {
+    auto j = record_to_json<RecordJson>(record, fields);
+
+    if(tables) {
+        if((fields & RecordField_Location) && record.has(RecordFlag_HasFileName)) {
+            j["location"]["fileName"] = intern(record.fileName, tables->files, files);
+        }
+        if(fields & RecordField_KindName) {
+            j["kind_name"] = intern(record.kindName, tables->kinds, kinds);
+        }
+        if(fields & RecordField_TypeName) {
+            j["type_name"] = intern(record.typeName, tables->types, types);
+        }
+        auto language = language_name(record.language);
+        if((fields & RecordField_Language) && language) {
+            j["language"] = intern(language, tables->languages, languages);
+        }
+    }
+
+    return j;
+}
+
+void RecordEncoder::encode(const Record& record, OutputFormat format, std::string& out) {
+    {
+        ArenaScope scope(arena);
+        encode_record(to_json(record), format, out);
+    }
+    arena.reset();
+}
+
+void RecordEncoder::dump(const Record& record, int indent, std::string& out) {
+    {
+        ArenaScope scope(arena);
+        out = to_json(record).dump(indent);
+    }
+    arena.reset();
+}
+
+JsonArrayWriter::JsonArrayWriter(std::ostream& out, RecordEncoder& encoder, unsigned indent)
+    : out(out), encoder(encoder), outer(indent, ' '), inner(indent + 2, ' '), nested("\n" + inner) {}
+
+void JsonArrayWriter::write(const RecordStore& store, TranslationUnitStats *stats) {
+    for(size_t row = 0; row < store.size(); row++) {
+        store.get(row, record);
+
+        {
+            PhaseTimer timer(stats, TranslationUnitStats::Serialize);
+            encoder.dump(record, 2, text);
+            for(size_t newline = text.find('\n'); newline != std::string::npos; newline = text.find('\n', newline + nested.size())) {
+                text.replace(newline, 1, nested);
+            }
+        }
+
+        {
+            PhaseTimer timer(stats, TranslationUnitStats::Write);
+            out << (empty ? "[\n" : ",\n") << inner << text;
+        }
+        if(stats) {
+            stats->outputBytes += 2 + inner.size() + text.size();
+        }
+        empty = false;
+    }
+}
+
+void JsonArrayWriter::finish() {
+    if(empty) {
+        out << "[]";
+    }
+    else {
+        out << "\n" << outer << "]";
+    }
+}
+
+void RecordStoreSink::write(const Record& record) {
+    store.append(record);
+}
+
+StreamingSink::~StreamingSink() {
+    flush();
+}
+
+void StreamingSink::write(const Record& record) {
+    auto size = buffer.size();
+    {
+        PhaseTimer timer(stats, TranslationUnitStats::Serialize);
+        encoder.encode(record, format, buffer);
+    }
+    if(stats) {
+        stats->outputBytes += buffer.size() - size;
+    }
+
+    if(buffer.size() >= flushThreshold) {
+        flush();
+    }
+}
+
+void StreamingSink::write_value(const json& value) {
+    encode_record(value, format, buffer);
+}
+
+void StreamingSink::flush() {
+    if(buffer.empty()) {
+        return;
+    }
+
+    {
+        PhaseTimer timer(stats, TranslationUnitStats::Write);
+        out.write(buffer);
+    }
+    buffer.clear();
+}
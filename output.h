@@ -0,0 +1,211 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "json.hpp"
+#include "record.h"
+#include "stats.h"
+
+enum class OutputFormat {
+    Json,
+    Ndjson,
+    Cbor,
+    MessagePack,
+    Ubjson,
+    Bson,
+    // a sorted tags file and an Emacs TAGS file, written by TagSink and
+    // ExternalSorter rather than record by record
+    Ctags,
+    Etags,
+};
+
+OutputFormat parse_output_format(const std::string& name);
+
+// The bundled json.hpp predates BSON support, so records are encoded by hand.
+// Appends one BSON document; record must be an object.
+template<typename Json>
+void append_bson(const Json& record, std::string& out);
+
+// Appends record to out in the given streaming format. Instantiated for json
+// and RecordJson.
+template<typename Json>
+void encode_record(const Json& record, OutputFormat format, std::string& out);
+
+// Run-wide table of strings, handing out dense ids in first-seen order.
+class StringTable {
+public:
+    size_t intern(const std::string& value);
+    size_t size() const;
+    std::string at(size_t id) const;
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, size_t> ids;
+    std::deque<std::string> values;
+};
+
+// The fields that --intern replaces with ids into these tables.
+struct StringTables {
+    StringTable files;
+    StringTable kinds;
+    StringTable types;
+    StringTable languages;
+
+    json to_json() const;
+};
+
+// Destination shared by every worker. Chunks are written whole under a lock,
+// so records never interleave mid-line.
+class OutputStream {
+public:
+    OutputStream(std::ostream& out, OutputFormat format, StringTables *tables = nullptr)
+        : out(out), format(format), tables(tables) {}
+
+    void write(const std::string& chunk);
+
+private:
+    void write_string_definitions(const char *name, const StringTable& table, size_t& written);
+
+    std::ostream& out;
+    std::mutex mutex;
+    OutputFormat format;
+
+    // When interning, table entries are written ahead of the first chunk that
+    // could refer to them.
+    StringTables *tables;
+    size_t filesWritten = 0;
+    size_t kindsWritten = 0;
+    size_t typesWritten = 0;
+    size_t languagesWritten = 0;
+};
+
+// Turns records into json. With tables set, the repeated string fields are
+// replaced by ids into them; a per-encoder cache keeps the common case off
+// the tables' locks. Only the keys in fields are written. Each record's
+// document lives in the encoder's arena, which is reset once it has been
+// written out.
+class RecordEncoder {
+public:
+    explicit RecordEncoder(StringTables *tables = nullptr, uint32_t fields = RecordField_All)
+        : tables(tables), fields(fields) {}
+
+    // Appends record to out in the given streaming format.
+    void encode(const Record& record, OutputFormat format, std::string& out);
+    // Replaces out with record as json::dump(indent) would print it.
+    void dump(const Record& record, int indent, std::string& out);
+
+private:
+    typedef std::unordered_map<std::string, size_t> Cache;
+
+    RecordJson to_json(const Record& record);
+    size_t intern(const std::string& value, StringTable& table, Cache& cache);
+
+    StringTables *tables;
+    uint32_t fields;
+    Arena arena;
+
+    Cache files;
+    Cache kinds;
+    Cache types;
+    Cache languages;
+};
+
+// Writes records as the pretty-printed json array, laid out exactly like
+// json::dump(2) of the whole array but one record at a time. indent is the
+// depth of the line the array starts on, for nesting it in an object.
+class JsonArrayWriter {
+public:
+    JsonArrayWriter(std::ostream& out, RecordEncoder& encoder, unsigned indent = 0);
+
+    // Appends every record of store. If stats is set, it receives their
+    // serialize and write times.
+    void write(const RecordStore& store, TranslationUnitStats *stats = nullptr);
+    // Closes the array.
+    void finish();
+
+private:
+    std::ostream& out;
+    RecordEncoder& encoder;
+    std::string outer;
+    std::string inner;
+    std::string nested;
+
+    bool empty = true;
+    Record record;
+    std::string text;
+};
+
+// Receives the records produced by cursor_visitor.
+class RecordSink {
+public:
+    virtual ~RecordSink() = default;
+
+    virtual void write(const Record& record) = 0;
+    virtual void flush() {}
+};
+
+// Keeps records in a columnar store, for the pretty-printed json output and
+// for the daemon.
+class RecordStoreSink : public RecordSink {
+public:
+    explicit RecordStoreSink(RecordStore& store) : store(store) {}
+
+    void write(const Record& record) override;
+
+private:
+    RecordStore& store;
+};
+
+// Serializes each record as soon as it is visited and hands it to the shared
+// OutputStream in bounded chunks, so memory does not grow with the TU.
+// Binary formats are written as a plain concatenation of one value per record.
+class StreamingSink : public RecordSink {
+public:
+    StreamingSink(OutputStream& out, OutputFormat format, StringTables *tables = nullptr,
+                  uint32_t fields = RecordField_All)
+        : out(out), format(format), encoder(tables, fields) {}
+    ~StreamingSink() override;
+
+    void write(const Record& record) override;
+    // For values other than records, such as --watch's markers.
+    void write_value(const json& value);
+    void flush() override;
+
+    // Where the records written from now on account their serialize and
+    // write times and output bytes, or null.
+    void set_stats(TranslationUnitStats *stats) { this->stats = stats; }
+
+    static const size_t flushThreshold = 64 * 1024;
+
+private:
+    OutputStream& out;
+    OutputFormat format;
+    RecordEncoder encoder;
+    std::string buffer;
+    TranslationUnitStats *stats = nullptr;
+};
+
+// Passes every record to builder.add() on its way to target, for outputs
+// built from the whole run such as the USR index.
+template<typename Builder>
+class CollectingSink : public RecordSink {
+public:
+    CollectingSink(Builder& builder, RecordSink& target) : builder(builder), target(target) {}
+
+    void write(const Record& record) override {
+        builder.add(record);
+        target.write(record);
+    }
+
+    void flush() override {
+        target.flush();
+    }
+
+private:
+    Builder& builder;
+    RecordSink& target;
+};
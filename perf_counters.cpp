@@ -0,0 +1,124 @@
+#include "perf_counters.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+PerfCounters& PerfCounters::for_this_thread() {
+    thread_local PerfCounters counters;
+    return counters;
+}
+
+const char *PerfCounters::name(int counter) {
+    static const char *names[] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+    return names[counter];
+}
+
+#ifdef __linux__
+
+PerfCounters::PerfCounters() {
+    static const uint64_t configs[CounterCount] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    for(int counter = 0; counter < CounterCount; counter++) {
+        fds[counter] = -1;
+        slots[counter] = -1;
+
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[counter];
+        // user space only, which perf_event_paranoid 2 still allows
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // this thread, any CPU, all in one group so a single read gets them all
+        auto fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+        if(fd < 0) {
+            if(reason.empty()) {
+                reason = std::string("perf_event_open: ") + std::strerror(errno);
+            }
+            continue;
+        }
+
+        if(leader < 0) {
+            leader = fd;
+        }
+        fds[counter] = fd;
+        slots[counter] = members++;
+        available |= 1u << counter;
+    }
+
+    if(available) {
+        reason.clear();
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for(int counter = 0; counter < CounterCount; counter++) {
+        if(fds[counter] >= 0) {
+            close(fds[counter]);
+        }
+    }
+}
+
+bool PerfCounters::read(uint64_t values[CounterCount]) const {
+    for(int counter = 0; counter < CounterCount; counter++) {
+        values[counter] = 0;
+    }
+    if(leader < 0) {
+        return false;
+    }
+
+    // nr, time_enabled, time_running, then one value per member
+    uint64_t buffer[3 + CounterCount];
+    auto size = ::read(leader, buffer, sizeof(buffer));
+    if(size < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buffer[0] != static_cast<uint64_t>(members)) {
+        return false;
+    }
+
+    // scale up if the group had to share the PMU with other events
+    auto enabled = buffer[1];
+    auto running = buffer[2];
+    for(int counter = 0; counter < CounterCount; counter++) {
+        if(slots[counter] < 0) {
+            continue;
+        }
+        auto value = buffer[3 + slots[counter]];
+        values[counter] = running && running < enabled
+                ? static_cast<uint64_t>(static_cast<double>(value) * enabled / running)
+                : value;
+    }
+    return true;
+}
+
+#else
+
+PerfCounters::PerfCounters() : reason("hardware counters are only supported on Linux") {
+    for(int counter = 0; counter < CounterCount; counter++) {
+        fds[counter] = -1;
+        slots[counter] = -1;
+    }
+}
+
+PerfCounters::~PerfCounters() {}
+
+bool PerfCounters::read(uint64_t values[CounterCount]) const {
+    for(int counter = 0; counter < CounterCount; counter++) {
+        values[counter] = 0;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Hardware counters of the calling thread, read through Linux
+// perf_event_open. Opening fails softly: on other platforms, in containers
+// without access to the PMU, or with a strict perf_event_paranoid, counters
+// are just reported as unavailable. Events the CPU does not have are left
+// out of the mask and the rest still count.
+class PerfCounters {
+public:
+    enum Counter {
+        Cycles,
+        Instructions,
+        CacheMisses,
+        BranchMisses,
+        CounterCount,
+    };
+
+    // The counters of the calling thread, opened on first use.
+    static PerfCounters& for_this_thread();
+
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Bit (1 << Counter) is set for every counter that is counting.
+    unsigned mask() const { return available; }
+    // Why nothing is counting, if so.
+    const std::string& error() const { return reason; }
+
+    // Fills values with the counts so far, zero for counters not in mask().
+    // Returns false if nothing could be read.
+    bool read(uint64_t values[CounterCount]) const;
+
+    static const char *name(int counter);
+
+private:
+    PerfCounters();
+
+    // the group leader, or -1
+    int leader = -1;
+    int fds[CounterCount];
+    // position of each counter in a group read
+    int slots[CounterCount];
+    int members = 0;
+    unsigned available = 0;
+    std::string reason;
+};
@@ -0,0 +1,263 @@
+#include "record.h"
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include "hash.h"
+
+namespace {
+
+template<typename T>
+size_t capacity_bytes(const std::vector<T>& column) {
+    return column.capacity() * sizeof(T);
+}
+
+}
+
+const char *language_name(uint8_t language) {
+    switch(language) {
+        case RecordLanguage_C:
+            return "c";
+        case RecordLanguage_Cpp:
+            return "cpp";
+        default:
+            return nullptr;
+    }
+}
+
+uint32_t parse_record_fields(const std::string& list) {
+    static const std::pair<const char *, RecordField> names[] = {
+        { "location", RecordField_Location },
+        { "extent", RecordField_Extent },
+        { "kind", RecordField_Kind },
+        { "kind_name", RecordField_KindName },
+        { "type", RecordField_Type },
+        { "type_name", RecordField_TypeName },
+        { "spelling", RecordField_Spelling },
+        { "display", RecordField_Display },
+        { "is_definition", RecordField_IsDefinition },
+        { "definition", RecordField_Definition },
+        { "is_static", RecordField_IsStatic },
+        { "is_reference", RecordField_IsReference },
+        { "usr", RecordField_Usr },
+        { "referencedUSR", RecordField_ReferencedUsr },
+        { "language", RecordField_Language },
+        { "qualified_name", RecordField_QualifiedName },
+    };
+
+    uint32_t fields = 0;
+    size_t start = 0;
+    while(start <= list.size()) {
+        auto comma = std::min(list.find(',', start), list.size());
+        auto name = list.substr(start, comma - start);
+        start = comma + 1;
+
+        if(name == "all") {
+            fields |= RecordField_All;
+            continue;
+        }
+
+        auto it = std::find_if(std::begin(names), std::end(names), [&name](const std::pair<const char *, RecordField>& entry) {
+            return name == entry.first;
+        });
+        if(it == std::end(names)) {
+            throw std::runtime_error("unknown field: " + name);
+        }
+        fields |= it->second;
+    }
+    return fields;
+}
+
+void record_from_json(const json& j, Record& record) {
+    auto text = [](const json& value, std::string& out) {
+        if(value.is_string()) {
+            out = value.get<std::string>();
+            return true;
+        }
+        out.clear();
+        return false;
+    };
+
+    record.flags = 0;
+
+    auto& location = j.at("location");
+    record.set(RecordFlag_HasFileName, text(location.at("fileName"), record.fileName));
+    record.line = location.at("line").get<unsigned>();
+    record.column = location.at("column").get<unsigned>();
+    record.offset = location.at("offset").get<unsigned>();
+
+    auto& start = j.at("extent").at("start");
+    auto& end = j.at("extent").at("end");
+    record.startLine = start.at("line").get<unsigned>();
+    record.startColumn = start.at("column").get<unsigned>();
+    record.startOffset = start.at("offset").get<unsigned>();
+    record.endLine = end.at("line").get<unsigned>();
+    record.endColumn = end.at("column").get<unsigned>();
+    record.endOffset = end.at("offset").get<unsigned>();
+
+    record.kind = j.at("kind").get<unsigned>();
+    text(j.at("kind_name"), record.kindName);
+    record.type = j.at("type").get<unsigned>();
+    text(j.at("type_name"), record.typeName);
+    text(j.at("spelling"), record.spelling);
+    text(j.at("display"), record.display);
+    text(j.at("usr"), record.usr);
+    record.set(RecordFlag_HasDefinition, text(j.at("definition"), record.definition));
+    record.set(RecordFlag_HasReferenced, text(j.at("referencedUSR"), record.referencedUSR));
+
+    record.set(RecordFlag_Definition, j.at("is_definition").get<bool>());
+    record.set(RecordFlag_Static, j.at("is_static").get<bool>());
+    record.set(RecordFlag_Reference, j.at("is_reference").get<bool>());
+
+    auto& language = j.at("language");
+    if(language == "c") {
+        record.language = RecordLanguage_C;
+    }
+    else if(language == "cpp") {
+        record.language = RecordLanguage_Cpp;
+    }
+    else {
+        record.language = RecordLanguage_None;
+    }
+
+    record.set(RecordFlag_HasQualifiedName, j.count("qualified_name") && text(j["qualified_name"], record.qualifiedName));
+}
+
+uint32_t StringPool::find(const char *str, size_t length, uint64_t hash, size_t& slot) const {
+    auto mask = slots.size() - 1;
+    for(slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+        auto id = slots[slot] - 1;
+        if(this->length(id) == length && std::equal(str, str + length, data(id))) {
+            return id;
+        }
+    }
+    return npos;
+}
+
+uint32_t StringPool::find(const std::string& str) const {
+    if(slots.empty()) {
+        return npos;
+    }
+
+    size_t slot;
+    return find(str.data(), str.size(), fnv1a(str.data(), str.size()), slot);
+}
+
+void StringPool::grow() {
+    std::vector<uint32_t> grown(slots.empty() ? 1024 : slots.size() * 2, 0);
+    auto mask = grown.size() - 1;
+
+    for(uint32_t id = 0; id < size(); id++) {
+        auto slot = fnv1a(data(id), length(id)) & mask;
+        while(grown[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        grown[slot] = id + 1;
+    }
+
+    slots.swap(grown);
+}
+
+uint32_t StringPool::intern(const std::string& str) {
+    // keep the table at most half full
+    if((size() + 1) * 2 > slots.size()) {
+        grow();
+    }
+
+    size_t slot;
+    auto hash = fnv1a(str.data(), str.size());
+    auto id = find(str.data(), str.size(), hash, slot);
+    if(id != npos) {
+        return id;
+    }
+
+    id = static_cast<uint32_t>(size());
+    chars.insert(chars.end(), str.begin(), str.end());
+    offsets.push_back(static_cast<uint32_t>(chars.size()));
+    slots[slot] = id + 1;
+    return id;
+}
+
+size_t StringPool::memory_usage() const {
+    return capacity_bytes(chars) + capacity_bytes(offsets) + capacity_bytes(slots);
+}
+
+void RecordStore::append(const Record& record) {
+    auto nullable = [this, &record](RecordFlags flag, const std::string& str) {
+        return record.has(flag) ? strings.intern(str) : StringPool::npos;
+    };
+
+    fileName.push_back(nullable(RecordFlag_HasFileName, record.fileName));
+    line.push_back(record.line);
+    column.push_back(record.column);
+    offset.push_back(record.offset);
+
+    startLine.push_back(record.startLine);
+    startColumn.push_back(record.startColumn);
+    startOffset.push_back(record.startOffset);
+    endLine.push_back(record.endLine);
+    endColumn.push_back(record.endColumn);
+    endOffset.push_back(record.endOffset);
+
+    kind.push_back(static_cast<uint16_t>(record.kind));
+    kindName.push_back(strings.intern(record.kindName));
+    type.push_back(static_cast<uint16_t>(record.type));
+    typeName.push_back(strings.intern(record.typeName));
+    spelling.push_back(strings.intern(record.spelling));
+    display.push_back(strings.intern(record.display));
+    usr.push_back(strings.intern(record.usr));
+    definition.push_back(nullable(RecordFlag_HasDefinition, record.definition));
+    referencedUSR.push_back(nullable(RecordFlag_HasReferenced, record.referencedUSR));
+    qualifiedName.push_back(nullable(RecordFlag_HasQualifiedName, record.qualifiedName));
+
+    flags.push_back(record.flags);
+    language.push_back(record.language);
+}
+
+void RecordStore::get(size_t row, Record& record) const {
+    auto text = [this](uint32_t id, std::string& out) {
+        if(id == StringPool::npos) {
+            out.clear();
+        }
+        else {
+            out.assign(strings.data(id), strings.length(id));
+        }
+    };
+
+    text(fileName[row], record.fileName);
+    record.line = line[row];
+    record.column = column[row];
+    record.offset = offset[row];
+
+    record.startLine = startLine[row];
+    record.startColumn = startColumn[row];
+    record.startOffset = startOffset[row];
+    record.endLine = endLine[row];
+    record.endColumn = endColumn[row];
+    record.endOffset = endOffset[row];
+
+    record.kind = kind[row];
+    text(kindName[row], record.kindName);
+    record.type = type[row];
+    text(typeName[row], record.typeName);
+    text(spelling[row], record.spelling);
+    text(display[row], record.display);
+    text(usr[row], record.usr);
+    text(definition[row], record.definition);
+    text(referencedUSR[row], record.referencedUSR);
+    text(qualifiedName[row], record.qualifiedName);
+
+    record.flags = flags[row];
+    record.language = language[row];
+}
+
+size_t RecordStore::memory_usage() const {
+    return strings.memory_usage() +
+           capacity_bytes(fileName) + capacity_bytes(line) + capacity_bytes(column) + capacity_bytes(offset) +
+           capacity_bytes(startLine) + capacity_bytes(startColumn) + capacity_bytes(startOffset) +
+           capacity_bytes(endLine) + capacity_bytes(endColumn) + capacity_bytes(endOffset) +
+           capacity_bytes(kind) + capacity_bytes(kindName) + capacity_bytes(type) + capacity_bytes(typeName) +
+           capacity_bytes(spelling) + capacity_bytes(display) + capacity_bytes(usr) +
+           capacity_bytes(definition) + capacity_bytes(referencedUSR) + capacity_bytes(qualifiedName) +
+           capacity_bytes(flags) + capacity_bytes(language);
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// json whose nodes come from the thread's current arena, for the short-lived
+// documents built while serializing a record.
+typedef nlohmann::basic_json<std::map, std::vector, std::string, bool, std::int64_t,
+                             std::uint64_t, double, ArenaAllocator> RecordJson;
+
+enum RecordFlags : uint8_t {
+    RecordFlag_Definition = 1 << 0,
+    RecordFlag_Static = 1 << 1,
+    RecordFlag_Reference = 1 << 2,
+    // which of the nullable strings are set
+    RecordFlag_HasFileName = 1 << 3,
+    RecordFlag_HasDefinition = 1 << 4,
+    RecordFlag_HasReferenced = 1 << 5,
+    RecordFlag_HasQualifiedName = 1 << 6,
+};
+
+enum RecordLanguage : uint8_t {
+    RecordLanguage_None,
+    RecordLanguage_C,
+    RecordLanguage_Cpp,
+};
+
+// The top-level keys of a record's json, for --fields. cursor_visitor only
+// asks libclang for the fields in its mask.
+enum RecordField : uint32_t {
+    RecordField_Location = 1 << 0,
+    RecordField_Extent = 1 << 1,
+    RecordField_Kind = 1 << 2,
+    RecordField_KindName = 1 << 3,
+    RecordField_Type = 1 << 4,
+    RecordField_TypeName = 1 << 5,
+    RecordField_Spelling = 1 << 6,
+    RecordField_Display = 1 << 7,
+    RecordField_IsDefinition = 1 << 8,
+    RecordField_Definition = 1 << 9,
+    RecordField_IsStatic = 1 << 10,
+    RecordField_IsReference = 1 << 11,
+    RecordField_Usr = 1 << 12,
+    RecordField_ReferencedUsr = 1 << 13,
+    RecordField_Language = 1 << 14,
+    // only present on declarations, and only computed when asked for
+    RecordField_QualifiedName = 1 << 15,
+    RecordField_All = (1 << 16) - 1,
+};
+
+// Parses a comma separated list of json keys, or "all".
+uint32_t parse_record_fields(const std::string& list);
+
+// One visited cursor. cursor_visitor fills a single Record in place for every
+// cursor, so the strings keep their capacity from one cursor to the next.
+struct Record {
+    std::string fileName;
+    unsigned line = 0;
+    unsigned column = 0;
+    unsigned offset = 0;
+
+    unsigned startLine = 0;
+    unsigned startColumn = 0;
+    unsigned startOffset = 0;
+    unsigned endLine = 0;
+    unsigned endColumn = 0;
+    unsigned endOffset = 0;
+
+    unsigned kind = 0;
+    std::string kindName;
+    unsigned type = 0;
+    std::string typeName;
+    std::string spelling;
+    std::string display;
+    std::string usr;
+    std::string definition;
+    std::string referencedUSR;
+    std::string qualifiedName;
+
+    uint8_t flags = 0;
+    uint8_t language = RecordLanguage_None;
+
+    bool has(RecordFlags flag) const { return (flags & flag) != 0; }
+    void set(RecordFlags flag, bool value) { flags = value ? (flags | flag) : (flags & ~flag); }
+};
+
+const char *language_name(uint8_t language);
+
+// The record in clangtags' json schema, limited to the keys in fields.
+template<typename Json = json>
+Json record_to_json(const Record& record, uint32_t fields = RecordField_All) {
+    auto nullable = [&record](RecordFlags flag, const std::string& str) {
+        return record.has(flag) ? Json(str) : Json(nullptr);
+    };
+
+    Json j = Json::object();
+    if(fields & RecordField_Location) {
+        j["location"] = Json::object({
+            { "fileName", nullable(RecordFlag_HasFileName, record.fileName) },
+            { "line", record.line },
+            { "column", record.column },
+            { "offset", record.offset }
+        });
+    }
+    if(fields & RecordField_Extent) {
+        j["extent"] = Json::object({
+            { "start", {
+                { "line", record.startLine },
+                { "column", record.startColumn },
+                { "offset", record.startOffset }
+            }},
+            { "end", {
+                { "line", record.endLine },
+                { "column", record.endColumn },
+                { "offset", record.endOffset }
+            }},
+        });
+    }
+    if(fields & RecordField_Kind) {
+        j["kind"] = record.kind;
+    }
+    if(fields & RecordField_KindName) {
+        j["kind_name"] = record.kindName;
+    }
+    if(fields & RecordField_Type) {
+        j["type"] = record.type;
+    }
+    if(fields & RecordField_TypeName) {
+        j["type_name"] = record.typeName;
+    }
+    if(fields & RecordField_Spelling) {
+        j["spelling"] = record.spelling;
+    }
+    if(fields & RecordField_Display) {
+        j["display"] = record.display;
+    }
+    if(fields & RecordField_IsDefinition) {
+        j["is_definition"] = record.has(RecordFlag_Definition);
+    }
+    if(fields & RecordField_Definition) {
+        j["definition"] = nullable(RecordFlag_HasDefinition, record.definition);
+    }
+    if(fields & RecordField_IsStatic) {
+        j["is_static"] = record.has(RecordFlag_Static);
+    }
+    if(fields & RecordField_IsReference) {
+        j["is_reference"] = record.has(RecordFlag_Reference);
+    }
+    if(fields & RecordField_Usr) {
+        j["usr"] = record.usr;
+    }
+    if(fields & RecordField_ReferencedUsr) {
+        j["referencedUSR"] = nullable(RecordFlag_HasReferenced, record.referencedUSR);
+    }
+    if(fields & RecordField_Language) {
+        auto language = language_name(record.language);
+        j["language"] = language ? Json(language) : Json(nullptr);
+    }
+    if((fields & RecordField_QualifiedName) && record.has(RecordFlag_HasQualifiedName)) {
+        j["qualified_name"] = record.qualifiedName;
+    }
+
+    return j;
+}
+
+void record_from_json(const json& j, Record& record);
+
+// Deduplicated strings packed into one buffer, addressed by dense ids.
+class StringPool {
+public:
+    static const uint32_t npos = UINT32_MAX;
+
+    uint32_t intern(const std::string& str);
+    // npos if str was never interned
+    uint32_t find(const std::string& str) const;
+
+    const char *data(uint32_t id) const { return chars.data() + offsets[id]; }
+    uint32_t length(uint32_t id) const { return offsets[id + 1] - offsets[id]; }
+    std::string at(uint32_t id) const { return std::string(data(id), length(id)); }
+
+    size_t size() const { return offsets.size() - 1; }
+    size_t memory_usage() const;
+
+private:
+    uint32_t find(const char *str, size_t length, uint64_t hash, size_t& slot) const;
+    void grow();
+
+    std::vector<char> chars;
+    std::vector<uint32_t> offsets{ 0 };
+    // open addressing over ids + 1, 0 meaning empty
+    std::vector<uint32_t> slots;
+};
+
+// Records stored column by column: one contiguous array per field, with
+// strings replaced by ids into a StringPool. Nullable strings hold npos.
+class RecordStore {
+public:
+    void append(const Record& record);
+    void get(size_t row, Record& record) const;
+
+    size_t size() const { return kind.size(); }
+    size_t memory_usage() const;
+
+    StringPool strings;
+
+    std::vector<uint32_t> fileName;
+    std::vector<uint32_t> line;
+    std::vector<uint32_t> column;
+    std::vector<uint32_t> offset;
+
+    std::vector<uint32_t> startLine;
+    std::vector<uint32_t> startColumn;
+    std::vector<uint32_t> startOffset;
+    std::vector<uint32_t> endLine;
+    std::vector<uint32_t> endColumn;
+    std::vector<uint32_t> endOffset;
+
+    std::vector<uint16_t> kind;
+    std::vector<uint32_t> kindName;
+    std::vector<uint16_t> type;
+    std::vector<uint32_t> typeName;
+    std::vector<uint32_t> spelling;
+    std::vector<uint32_t> display;
+    std::vector<uint32_t> usr;
+    std::vector<uint32_t> definition;
+    std::vector<uint32_t> referencedUSR;
+    std::vector<uint32_t> qualifiedName;
+
+    std::vector<uint8_t> flags;
+    std::vector<uint8_t> language;
+};
@@ -0,0 +1,176 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <sys/resource.h>
+
+namespace {
+
+const char *phase_name(int phase) {
+    static const char *names[] = { "parse", "visit", "replay", "serialize", "write" };
+    return names[phase];
+}
+
+}
+
+void TranslationUnitStats::add(const Record& record) {
+    cursors++;
+    if(record.kind >= cursorsByKind.size()) {
+        cursorsByKind.resize(record.kind + 1);
+    }
+    cursorsByKind[record.kind]++;
+}
+
+void TranslationUnitStats::merge(const TranslationUnitStats& other) {
+    for(int phase = 0; phase < PhaseCount; phase++) {
+        nanoseconds[phase] += other.nanoseconds[phase];
+    }
+    cursors += other.cursors;
+    if(other.cursorsByKind.size() > cursorsByKind.size()) {
+        cursorsByKind.resize(other.cursorsByKind.size());
+    }
+    for(size_t kind = 0; kind < other.cursorsByKind.size(); kind++) {
+        cursorsByKind[kind] += other.cursorsByKind[kind];
+    }
+    outputBytes += other.outputBytes;
+
+    for(auto& usage : other.clangMemory) {
+        clangMemory[usage.first] += usage.second;
+    }
+    recordStoreBytes += other.recordStoreBytes;
+    peakRssBytes = std::max(peakRssBytes, other.peakRssBytes);
+
+    hardwareMask |= other.hardwareMask;
+    for(int phase = 0; phase < PhaseCount; phase++) {
+        for(int counter = 0; counter < PerfCounters::CounterCount; counter++) {
+            hardware[phase][counter] += other.hardware[phase][counter];
+        }
+    }
+}
+
+uint64_t TranslationUnitStats::total_nanoseconds() const {
+    uint64_t total = 0;
+    for(int phase = 0; phase < PhaseCount; phase++) {
+        total += nanoseconds[phase];
+    }
+    return total;
+}
+
+uint64_t TranslationUnitStats::total_clang_memory() const {
+    uint64_t total = 0;
+    for(auto& usage : clangMemory) {
+        total += usage.second;
+    }
+    return total;
+}
+
+void TranslationUnitStats::total_hardware(uint64_t totals[PerfCounters::CounterCount]) const {
+    for(int counter = 0; counter < PerfCounters::CounterCount; counter++) {
+        totals[counter] = 0;
+        for(int phase = 0; phase < PhaseCount; phase++) {
+            totals[counter] += hardware[phase][counter];
+        }
+    }
+}
+
+json TranslationUnitStats::to_json(const std::function<std::string(unsigned)>& kindName) const {
+    json j;
+
+    auto& seconds = j["seconds"] = json::object();
+    for(int phase = 0; phase < PhaseCount; phase++) {
+        seconds[phase_name(phase)] = nanoseconds[phase] / 1e9;
+    }
+    seconds["total"] = total_nanoseconds() / 1e9;
+
+    j["cursors"] = cursors;
+    auto& kinds = j["cursors_by_kind"] = json::object();
+    for(size_t kind = 0; kind < cursorsByKind.size(); kind++) {
+        if(cursorsByKind[kind]) {
+            kinds[kindName(static_cast<unsigned>(kind))] = cursorsByKind[kind];
+        }
+    }
+    j["output_bytes"] = outputBytes;
+
+    auto& memory = j["memory_bytes"] = json::object();
+    auto& clang = memory["clang"] = json::object();
+    for(auto& usage : clangMemory) {
+        clang[usage.first] = usage.second;
+    }
+    clang["total"] = total_clang_memory();
+    memory["record_store"] = recordStoreBytes;
+    memory["process_peak_rss"] = peakRssBytes;
+
+    if(hardwareMask) {
+        auto phase_counters = [this](const uint64_t values[PerfCounters::CounterCount]) {
+            json counters;
+            for(int counter = 0; counter < PerfCounters::CounterCount; counter++) {
+                if(hardwareMask & (1u << counter)) {
+                    counters[PerfCounters::name(counter)] = values[counter];
+                }
+            }
+            return counters;
+        };
+
+        auto& hardwareCounters = j["hardware_counters"] = json::object();
+        for(int phase = 0; phase < PhaseCount; phase++) {
+            hardwareCounters[phase_name(phase)] = phase_counters(hardware[phase]);
+        }
+        uint64_t totals[PerfCounters::CounterCount];
+        total_hardware(totals);
+        hardwareCounters["total"] = phase_counters(totals);
+    }
+
+    return j;
+}
+
+uint64_t peak_rss_bytes() {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    // kilobytes everywhere else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+PhaseTimer::PhaseTimer(TranslationUnitStats *stats, TranslationUnitStats::Phase phase) : stats(stats), phase(phase) {
+    if(!stats) {
+        return;
+    }
+
+    if(stats->countHardware) {
+        auto& threadCounters = PerfCounters::for_this_thread();
+        if(threadCounters.read(countersStart)) {
+            counters = &threadCounters;
+            stats->total_hardware(nestedCountersStart);
+        }
+    }
+
+    nestedStart = stats->total_nanoseconds();
+    start = std::chrono::steady_clock::now();
+}
+
+PhaseTimer::~PhaseTimer() {
+    if(!stats) {
+        return;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    auto nested = stats->total_nanoseconds() - nestedStart;
+    stats->nanoseconds[phase] += std::max<uint64_t>(static_cast<uint64_t>(elapsed), nested) - nested;
+
+    uint64_t countersEnd[PerfCounters::CounterCount];
+    if(counters && counters->read(countersEnd)) {
+        uint64_t nestedCountersEnd[PerfCounters::CounterCount];
+        stats->total_hardware(nestedCountersEnd);
+
+        for(int counter = 0; counter < PerfCounters::CounterCount; counter++) {
+            auto counted = countersEnd[counter] - countersStart[counter];
+            auto nestedCounted = nestedCountersEnd[counter] - nestedCountersStart[counter];
+            stats->hardware[phase][counter] += std::max(counted, nestedCounted) - nestedCounted;
+        }
+        stats->hardwareMask |= counters->mask();
+    }
+}
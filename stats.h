@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "json.hpp"
+#include "perf_counters.h"
+#include "record.h"
+
+// What --stats reports for one TU, or summed over the run.
+struct TranslationUnitStats {
+    enum Phase {
+        // clang_parseTranslationUnit2, or all of clang_indexSourceFile
+        Parse,
+        // clang_visitChildren and cursor_visitor
+        Visit,
+        // checking --cache and reading records back from it
+        Replay,
+        // encoding records
+        Serialize,
+        // handing encoded records to the output
+        Write,
+        PhaseCount,
+    };
+
+    // Phases are exclusive: time spent serializing during the visit counts
+    // towards Serialize only.
+    uint64_t nanoseconds[PhaseCount] = {};
+    uint64_t cursors = 0;
+    // indexed by CXCursorKind
+    std::vector<uint64_t> cursorsByKind;
+    uint64_t outputBytes = 0;
+    bool cached = false;
+
+    // What libclang said the parsed TU held, by clang_getCXTUResourceUsage
+    // category, in bytes. Summed when merged, although TUs on different
+    // workers are not all alive at once.
+    std::map<std::string, uint64_t> clangMemory;
+    // what the TU's RecordStore holds for the json output and the daemon
+    uint64_t recordStoreBytes = 0;
+    // the process's peak RSS once the TU was done, which also covers
+    // whatever the other workers were doing; the maximum when merged
+    uint64_t peakRssBytes = 0;
+    // --memory-budget: reparsed without function bodies or the
+    // preprocessing record, or left out altogether
+    bool degraded = false;
+    bool overBudget = false;
+
+    // With --perf-counters, PhaseTimer also reads the thread's hardware
+    // counters, attributing them to phases the same way as time. That costs
+    // two syscalls per timed phase, i.e. per record while serializing.
+    bool countHardware = false;
+    // the PerfCounters::mask() of the counters in hardware
+    unsigned hardwareMask = 0;
+    uint64_t hardware[PhaseCount][PerfCounters::CounterCount] = {};
+
+    // For CollectingSink.
+    void add(const Record& record);
+    void merge(const TranslationUnitStats& other);
+
+    uint64_t total_nanoseconds() const;
+    uint64_t total_clang_memory() const;
+    // hardware summed over the phases
+    void total_hardware(uint64_t totals[PerfCounters::CounterCount]) const;
+
+    json to_json(const std::function<std::string(unsigned)>& kindName) const;
+};
+
+// The process's peak resident set size so far.
+uint64_t peak_rss_bytes();
+
+// Adds the time until it goes out of scope to one phase of stats, minus
+// whatever other phases were timed in the meantime. Does nothing when stats
+// is null, so callers need not check.
+class PhaseTimer {
+public:
+    PhaseTimer(TranslationUnitStats *stats, TranslationUnitStats::Phase phase);
+    ~PhaseTimer();
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    TranslationUnitStats *stats;
+    TranslationUnitStats::Phase phase;
+    std::chrono::steady_clock::time_point start;
+    uint64_t nestedStart = 0;
+
+    // set while counting hardware
+    const PerfCounters *counters = nullptr;
+    uint64_t countersStart[PerfCounters::CounterCount];
+    uint64_t nestedCountersStart[PerfCounters::CounterCount];
+};
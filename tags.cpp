@@ -0,0 +1,389 @@
+#include "tags.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <clang-c/Index.h>
+#include <unistd.h>
+
+namespace {
+
+// Bytewise order of two '\n' terminated lines, a line sorting before the
+// longer ones it is a prefix of.
+bool line_less(const char *a, const char *b) {
+    for(;; a++, b++) {
+        if(*a == '\n') {
+            return *b != '\n';
+        }
+        if(*b == '\n') {
+            return false;
+        }
+        if(*a != *b) {
+            return static_cast<unsigned char>(*a) < static_cast<unsigned char>(*b);
+        }
+    }
+}
+
+bool line_equal(const char *a, const char *b) {
+    return !line_less(a, b) && !line_less(b, a);
+}
+
+size_t line_size(const char *line) {
+    return static_cast<size_t>(std::strchr(line, '\n') - line) + 1;
+}
+
+// One sorted run being read back during a merge. line() includes the '\n'.
+class RunReader {
+public:
+    explicit RunReader(const std::string& path) : in(path, std::ios::binary) {
+        if(!in) {
+            throw std::runtime_error("failed to open sort run: " + path);
+        }
+        next();
+    }
+
+    explicit RunReader(const SortBuffer& buffer) : buffer(&buffer) {
+        next();
+    }
+
+    bool done() const { return finished; }
+    const char *line() const { return current; }
+
+    void next() {
+        if(buffer) {
+            if(row == buffer->size()) {
+                finished = true;
+                return;
+            }
+            current = buffer->line(row++);
+            return;
+        }
+
+        if(!std::getline(in, text)) {
+            finished = true;
+            return;
+        }
+        text += '\n';
+        current = text.data();
+    }
+
+private:
+    std::ifstream in;
+    std::string text;
+
+    const SortBuffer *buffer = nullptr;
+    size_t row = 0;
+
+    const char *current = nullptr;
+    bool finished = false;
+};
+
+// Merges runs, calling write with each distinct line.
+void merge_runs(std::vector<RunReader*> runs, const std::function<void(const char *line, size_t size)>& write) {
+    auto greater = [](const RunReader *a, const RunReader *b) {
+        return line_less(b->line(), a->line());
+    };
+    std::priority_queue<RunReader*, std::vector<RunReader*>, decltype(greater)> heap(greater);
+    for(auto run : runs) {
+        if(!run->done()) {
+            heap.push(run);
+        }
+    }
+
+    // every run is sorted and deduplicated, so duplicates can only come from
+    // different runs, one after the other
+    std::string last;
+    while(!heap.empty()) {
+        auto run = heap.top();
+        heap.pop();
+
+        auto line = run->line();
+        if(last.empty() || !line_equal(line, last.data())) {
+            auto size = line_size(line);
+            last.assign(line, size);
+            write(line, size);
+        }
+
+        run->next();
+        if(!run->done()) {
+            heap.push(run);
+        }
+    }
+}
+
+}
+
+void SortBuffer::add(const std::string& line) {
+    starts.push_back(data.size());
+    data += line;
+    data += '\n';
+}
+
+void SortBuffer::sort() {
+    auto text = data.data();
+    std::sort(starts.begin(), starts.end(), [text](size_t a, size_t b) {
+        return line_less(text + a, text + b);
+    });
+
+    starts.erase(std::unique(starts.begin(), starts.end(), [text](size_t a, size_t b) {
+        return line_equal(text + a, text + b);
+    }), starts.end());
+}
+
+void SortBuffer::clear() {
+    data.clear();
+    starts.clear();
+}
+
+const size_t ExternalSorter::maxFanIn;
+
+ExternalSorter::ExternalSorter(size_t runBytes, std::string directory) : runBytes(runBytes), directory(std::move(directory)) {
+    if(this->directory.empty()) {
+        auto tmp = std::getenv("TMPDIR");
+        this->directory = tmp && *tmp ? tmp : "/tmp";
+    }
+}
+
+ExternalSorter::~ExternalSorter() {
+    remove_files();
+}
+
+std::string ExternalSorter::create_run_file() {
+    auto path = directory + "/clangtags-sort-XXXXXX";
+    auto fd = mkstemp(&path[0]);
+    if(fd < 0) {
+        throw std::runtime_error("failed to create sort run in " + directory);
+    }
+    close(fd);
+    return path;
+}
+
+std::string ExternalSorter::write_run(const SortBuffer& buffer) {
+    auto path = create_run_file();
+
+    std::ofstream out(path, std::ios::binary);
+    for(size_t row = 0; row < buffer.size(); row++) {
+        auto line = buffer.line(row);
+        out.write(line, static_cast<std::streamsize>(line_size(line)));
+    }
+    if(!out) {
+        std::remove(path.c_str());
+        throw std::runtime_error("failed to write sort run: " + path);
+    }
+    return path;
+}
+
+void ExternalSorter::add_run(SortBuffer& buffer, bool spill) {
+    if(buffer.empty()) {
+        return;
+    }
+
+    buffer.sort();
+
+    if(!spill) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffers.push_back(std::move(buffer));
+        buffer.clear();
+        return;
+    }
+
+    auto path = write_run(buffer);
+    buffer.clear();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    files.push_back(path);
+}
+
+void ExternalSorter::merge(std::ostream& out) {
+    merge([&out](const char *line, size_t size) {
+        out.write(line, static_cast<std::streamsize>(size));
+    });
+}
+
+void ExternalSorter::merge(const std::function<void(const char *line, size_t size)>& write) {
+    // only ever a handful of buffers, one per worker, but any number of files
+    while(files.size() + buffers.size() > maxFanIn && files.size() > 1) {
+        auto count = std::min(maxFanIn, files.size());
+        std::vector<std::unique_ptr<RunReader>> readers;
+        std::vector<RunReader*> runs;
+        for(size_t i = 0; i < count; i++) {
+            readers.emplace_back(new RunReader(files[i]));
+            runs.push_back(readers.back().get());
+        }
+
+        auto path = create_run_file();
+        {
+            std::ofstream merged(path, std::ios::binary);
+            merge_runs(runs, [&merged](const char *line, size_t size) {
+                merged.write(line, static_cast<std::streamsize>(size));
+            });
+            if(!merged) {
+                throw std::runtime_error("failed to write sort run: " + path);
+            }
+        }
+
+        readers.clear();
+        for(size_t i = 0; i < count; i++) {
+            std::remove(files[i].c_str());
+        }
+        files.erase(files.begin(), files.begin() + static_cast<std::ptrdiff_t>(count));
+        files.push_back(path);
+    }
+
+    std::vector<std::unique_ptr<RunReader>> readers;
+    std::vector<RunReader*> runs;
+    for(auto& file : files) {
+        readers.emplace_back(new RunReader(file));
+        runs.push_back(readers.back().get());
+    }
+    for(auto& buffer : buffers) {
+        readers.emplace_back(new RunReader(buffer));
+        runs.push_back(readers.back().get());
+    }
+
+    merge_runs(runs, write);
+
+    readers.clear();
+    remove_files();
+    buffers.clear();
+}
+
+void ExternalSorter::remove_files() {
+    for(auto& file : files) {
+        std::remove(file.c_str());
+    }
+    files.clear();
+}
+
+char ctags_kind(unsigned kind, bool definition) {
+    // forward declarations and prototypes would compete with the definition
+    // for the same name, so like ctags' defaults only the definition is kept
+    switch(kind) {
+        case CXCursor_StructDecl:
+            return definition ? 's' : 0;
+        case CXCursor_UnionDecl:
+            return definition ? 'u' : 0;
+        case CXCursor_ClassDecl:
+        case CXCursor_ClassTemplate:
+        case CXCursor_ClassTemplatePartialSpecialization:
+            return definition ? 'c' : 0;
+        case CXCursor_EnumDecl:
+            return definition ? 'g' : 0;
+        case CXCursor_EnumConstantDecl:
+            return 'e';
+        case CXCursor_FieldDecl:
+            return 'm';
+        case CXCursor_FunctionDecl:
+        case CXCursor_CXXMethod:
+        case CXCursor_Constructor:
+        case CXCursor_Destructor:
+        case CXCursor_ConversionFunction:
+        case CXCursor_FunctionTemplate:
+            return definition ? 'f' : 0;
+        case CXCursor_VarDecl:
+            return definition ? 'v' : 0;
+        case CXCursor_TypedefDecl:
+        case CXCursor_TypeAliasDecl:
+            return 't';
+        case CXCursor_Namespace:
+        case CXCursor_NamespaceAlias:
+            return 'n';
+        case CXCursor_MacroDefinition:
+            return 'd';
+        default:
+            return 0;
+    }
+}
+
+TagSink::~TagSink() {
+    sorter.add_run(buffer, false);
+}
+
+void TagSink::write(const Record& record) {
+    auto kind = ctags_kind(record.kind, record.has(RecordFlag_Definition));
+    // a tab or newline in the file name would break the line apart
+    if(!kind || record.spelling.empty() || !record.has(RecordFlag_HasFileName) || record.fileName.empty() ||
+       record.fileName.find_first_of("\t\n") != std::string::npos) {
+        return;
+    }
+
+    {
+        PhaseTimer timer(stats, TranslationUnitStats::Serialize);
+        if(format == OutputFormat::Etags) {
+            // Emacs looks for the tag text at the start of the line, so with
+            // no text and the offset of the line's start it lands right there
+            char key[16];
+            std::snprintf(key, sizeof(key), "\t%010u\t", record.offset);
+            line.assign(record.fileName);
+            line += key;
+            line += '\x7f';
+            line += record.spelling;
+            line += '\x01';
+            line += std::to_string(record.line);
+            line += ',';
+            auto lineStart = record.column > 0 && record.column <= record.offset + 1
+                    ? record.offset + 1 - record.column
+                    : record.offset;
+            line += std::to_string(lineStart);
+        }
+        else {
+            line.assign(record.spelling);
+            line += '\t';
+            line += record.fileName;
+            line += '\t';
+            line += std::to_string(record.line);
+            line += ";\"\t";
+            line += kind;
+        }
+        buffer.add(line);
+    }
+    if(stats) {
+        stats->outputBytes += line.size() + 1;
+    }
+
+    if(buffer.memory_usage() >= sorter.run_bytes()) {
+        PhaseTimer timer(stats, TranslationUnitStats::Write);
+        sorter.add_run(buffer);
+    }
+}
+
+void write_ctags(ExternalSorter& sorter, std::ostream& out) {
+    out << "!_TAG_FILE_FORMAT\t2\t/extended format; --format=1 will not append ;\" to lines/\n"
+        << "!_TAG_FILE_SORTED\t1\t/0=unsorted, 1=sorted, 2=foldcase/\n"
+        << "!_TAG_PROGRAM_NAME\tclangtags\t//\n";
+    sorter.merge(out);
+}
+
+void write_etags(ExternalSorter& sorter, std::ostream& out) {
+    std::string file;
+    std::string section;
+
+    // the size in the header has to be known up front, so each file's
+    // section is held until the next file starts
+    auto write_section = [&]() {
+        if(!file.empty()) {
+            out << "\f\n" << file << ',' << section.size() << '\n' << section;
+        }
+        section.clear();
+    };
+
+    sorter.merge([&](const char *line, size_t size) {
+        // file \t offset \t tag
+        auto fileEnd = static_cast<const char*>(std::memchr(line, '\t', size));
+        auto tag = static_cast<const char*>(std::memchr(fileEnd + 1, '\t', size - (fileEnd + 1 - line))) + 1;
+
+        if(file.compare(0, std::string::npos, line, static_cast<size_t>(fileEnd - line)) != 0) {
+            write_section();
+            file.assign(line, fileEnd);
+        }
+        section.append(tag, line + size);
+    });
+
+    write_section();
+}
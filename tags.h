@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "output.h"
+#include "record.h"
+#include "stats.h"
+
+// '\n' terminated lines collected for ExternalSorter, kept in one string so
+// that tens of millions of them do not cost an allocation each.
+class SortBuffer {
+public:
+    // line must not contain '\n'
+    void add(const std::string& line);
+    void sort();
+    void clear();
+
+    bool empty() const { return starts.empty(); }
+    size_t size() const { return starts.size(); }
+    // the row'th line, '\n' included
+    const char *line(size_t row) const { return data.data() + starts[row]; }
+    size_t memory_usage() const { return data.size() + starts.size() * sizeof(size_t); }
+
+private:
+    std::string data;
+    // where each line starts in data
+    std::vector<size_t> starts;
+};
+
+// Sorts lines bytewise, as LC_ALL=C sort does, in bounded memory. Every
+// worker fills a SortBuffer of its own and hands it over as a sorted run
+// once it grows past run_bytes(); those runs go to temporary files. merge()
+// combines them, writing each distinct line once.
+class ExternalSorter {
+public:
+    // Runs are written to directory, or $TMPDIR or /tmp if it is empty.
+    explicit ExternalSorter(size_t runBytes, std::string directory = "");
+    ~ExternalSorter();
+
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    size_t run_bytes() const { return runBytes; }
+
+    // Sorts buffer and takes its lines as a run, leaving it empty. The run
+    // is written out unless spill is false, for the buffers that are left
+    // over at the end and fit in memory anyway. Thread-safe.
+    void add_run(SortBuffer& buffer, bool spill = true);
+    // Writes the merged runs to out and removes their files.
+    void merge(std::ostream& out);
+    // The same, handing each line, '\n' included, to write instead.
+    void merge(const std::function<void(const char *line, size_t size)>& write);
+
+    // Runs merged at a time; more than that are first merged into fewer.
+    static const size_t maxFanIn = 64;
+
+private:
+    std::string create_run_file();
+    std::string write_run(const SortBuffer& buffer);
+    void remove_files();
+
+    size_t runBytes;
+    std::string directory;
+
+    std::mutex mutex;
+    std::vector<std::string> files;
+    std::vector<SortBuffer> buffers;
+};
+
+// The ctags kind letter for a cursor of the given CXCursorKind, or 0 if it
+// does not make a tag. Types, functions and variables are only tagged where
+// they are defined, not where they are forward declared.
+char ctags_kind(unsigned kind, bool definition);
+
+// The fields TagSink needs.
+const uint32_t tagRecordFields = RecordField_Location | RecordField_Spelling | RecordField_IsDefinition;
+
+// Turns the records that make tags into lines for OutputFormat::Ctags or
+// OutputFormat::Etags and collects them for sorting. ctags lines are those
+// of an Exuberant/Universal-ctags tags file, addressed by line number. etags
+// lines are keyed by file and offset, for write_etags to group.
+class TagSink : public RecordSink {
+public:
+    TagSink(ExternalSorter& sorter, OutputFormat format) : sorter(sorter), format(format) {}
+    // Hands whatever is left to the sorter.
+    ~TagSink() override;
+
+    void write(const Record& record) override;
+
+    // Where the lines written from now on account their serialize and write
+    // times and output bytes, or null.
+    void set_stats(TranslationUnitStats *stats) { this->stats = stats; }
+
+private:
+    ExternalSorter& sorter;
+    OutputFormat format;
+    SortBuffer buffer;
+    std::string line;
+    TranslationUnitStats *stats = nullptr;
+};
+
+// Writes the lines collected in OutputFormat::Ctags as a tags file, with the
+// pseudo-tags that mark it as sorted.
+void write_ctags(ExternalSorter& sorter, std::ostream& out);
+// Writes the lines collected in OutputFormat::Etags as an Emacs TAGS file:
+// one section per file, headed by its name and size in bytes.
+void write_etags(ExternalSorter& sorter, std::ostream& out);
@@ -0,0 +1,80 @@
+#include "trace.h"
+
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+double microseconds(Tracer::Clock::duration duration) {
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+}
+
+Tracer::Tracer() : origin(Clock::now()) {
+    threads.emplace(std::this_thread::get_id(), 0);
+}
+
+unsigned Tracer::thread_id() {
+    auto it = threads.find(std::this_thread::get_id());
+    if(it == threads.end()) {
+        auto id = static_cast<unsigned>(threads.size());
+        it = threads.emplace(std::this_thread::get_id(), id).first;
+    }
+    return it->second;
+}
+
+void Tracer::add(const char *name, Clock::time_point start, Clock::time_point end, json args) {
+    json event;
+    event["name"] = name;
+    event["ph"] = "X";
+    event["ts"] = microseconds(start - origin);
+    event["dur"] = microseconds(end - start);
+    event["pid"] = 1;
+    if(!args.is_null()) {
+        event["args"] = std::move(args);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    event["tid"] = thread_id();
+    events.push_back(std::move(event));
+}
+
+void Tracer::write(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    json trace;
+    auto& traceEvents = trace["traceEvents"] = json::array();
+    for(size_t id = 0; id < threads.size(); id++) {
+        traceEvents.push_back({
+            { "name", "thread_name" },
+            { "ph", "M" },
+            { "pid", 1 },
+            { "tid", id },
+            { "args", { { "name", id == 0 ? std::string("main") : "worker " + std::to_string(id) } } },
+        });
+    }
+    for(auto& event : events) {
+        traceEvents.push_back(event);
+    }
+    trace["displayTimeUnit"] = "ms";
+
+    std::ofstream out(path);
+    out << trace.dump() << std::endl;
+    if(!out) {
+        throw std::runtime_error("failed to write trace: " + path);
+    }
+}
+
+TraceSpan::TraceSpan(Tracer *tracer, const char *name, json args)
+    : tracer(tracer), name(name), spanArgs(std::move(args)) {
+    if(tracer) {
+        start = Tracer::Clock::now();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if(tracer) {
+        tracer->add(name, start, Tracer::Clock::now(), std::move(spanArgs));
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+// Collects spans as Chrome trace-event "complete" events, for --trace. The
+// file opens in chrome://tracing or Perfetto, with a track per thread.
+class Tracer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    Tracer();
+
+    // Records a span of the calling thread.
+    void add(const char *name, Clock::time_point start, Clock::time_point end, json args = json());
+    void write(const std::string& path);
+
+private:
+    // under mutex
+    unsigned thread_id();
+
+    Clock::time_point origin;
+    std::mutex mutex;
+    std::vector<json> events;
+    // dense ids in order of first appearance; the thread that created the
+    // tracer is 0
+    std::map<std::thread::id, unsigned> threads;
+};
+
+// Adds a span from construction to destruction. Does nothing when tracer is
+// null, so callers need not check.
+class TraceSpan {
+public:
+    TraceSpan(Tracer *tracer, const char *name, json args = json());
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // Shown with the span; may be filled in while it is open.
+    json& args() { return spanArgs; }
+
+private:
+    Tracer *tracer;
+    const char *name;
+    Tracer::Clock::time_point start;
+    json spanArgs;
+};
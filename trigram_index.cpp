@@ -0,0 +1,348 @@
+#include "trigram_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+
+const char trigramIndexMagic[8] = { 'C', 'T', 'T', 'R', 'G', 'I', 'X', '1' };
+
+std::string fold_case(const std::string& str) {
+    std::string folded(str);
+    for(auto& c : folded) {
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    return folded;
+}
+
+// Appends the trigrams of an already case-folded string.
+void append_trigrams(const std::string& folded, std::vector<uint32_t>& trigrams) {
+    for(size_t i = 0; i + 3 <= folded.size(); i++) {
+        trigrams.push_back(static_cast<uint32_t>(static_cast<unsigned char>(folded[i])) << 16 |
+                           static_cast<uint32_t>(static_cast<unsigned char>(folded[i + 1])) << 8 |
+                           static_cast<uint32_t>(static_cast<unsigned char>(folded[i + 2])));
+    }
+}
+
+void sort_unique(std::vector<uint32_t>& values) {
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+}
+
+TrigramString append_string(std::string& strings, const std::string& str) {
+    // offsets are 32 bits in the file
+    if(strings.size() + str.size() > UINT32_MAX) {
+        throw std::runtime_error("failed to build trigram index: strings exceed 4 GiB");
+    }
+    TrigramString result{ static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(str.size()) };
+    strings += str;
+    return result;
+}
+
+}
+
+void TrigramIndexBuilder::add(const std::string& usr, Document document) {
+    auto it = documents.find(usr);
+    if(it == documents.end()) {
+        documents.emplace(usr, std::move(document));
+    }
+    else if(document.isDefinition && !it->second.isDefinition) {
+        it->second = std::move(document);
+    }
+}
+
+void TrigramIndexBuilder::add(const Record& record) {
+    if(record.usr.empty()) {
+        return;
+    }
+
+    Document document;
+    document.spelling = record.spelling;
+    document.display = record.display;
+    // the record is reused from cursor to cursor, so a name left over from
+    // the last declaration may still be in it
+    if(record.has(RecordFlag_HasQualifiedName)) {
+        document.qualifiedName = record.qualifiedName;
+    }
+    document.fileName = record.fileName;
+    document.line = record.line;
+    document.column = record.column;
+    document.isDefinition = record.has(RecordFlag_Definition);
+
+    add(record.usr, std::move(document));
+}
+
+void TrigramIndexBuilder::merge(TrigramIndexBuilder& other) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(auto& document : other.documents) {
+        add(document.first, std::move(document.second));
+    }
+    other.documents.clear();
+}
+
+void TrigramIndexBuilder::write(const std::string& path) const {
+    std::string strings;
+    std::unordered_map<std::string, TrigramString> fileNames;
+    std::vector<TrigramDocument> table;
+    table.reserve(documents.size());
+
+    // (trigram, document) pairs, grouped into posting lists below
+    std::vector<std::pair<uint32_t, uint32_t>> occurrences;
+    std::vector<uint32_t> trigrams;
+
+    for(auto& entry : documents) {
+        auto& document = entry.second;
+        auto id = static_cast<uint32_t>(table.size());
+
+        TrigramDocument row;
+        row.usr = append_string(strings, entry.first);
+        row.spelling = append_string(strings, document.spelling);
+        row.display = document.display == document.spelling ? row.spelling : append_string(strings, document.display);
+        row.qualifiedName = document.qualifiedName == document.spelling
+                ? row.spelling : append_string(strings, document.qualifiedName);
+
+        auto file = fileNames.find(document.fileName);
+        if(file == fileNames.end()) {
+            file = fileNames.emplace(document.fileName, append_string(strings, document.fileName)).first;
+        }
+        row.fileName = file->second;
+        row.line = document.line;
+        row.column = document.column;
+        table.push_back(row);
+
+        trigrams.clear();
+        append_trigrams(fold_case(document.spelling), trigrams);
+        append_trigrams(fold_case(document.display), trigrams);
+        append_trigrams(fold_case(document.qualifiedName), trigrams);
+        sort_unique(trigrams);
+        for(auto trigram : trigrams) {
+            occurrences.emplace_back(trigram, id);
+        }
+    }
+
+    std::sort(occurrences.begin(), occurrences.end());
+
+    std::vector<TrigramEntry> entries;
+    std::vector<uint32_t> postings;
+    postings.reserve(occurrences.size());
+    for(auto& occurrence : occurrences) {
+        if(entries.empty() || entries.back().trigram != occurrence.first) {
+            entries.push_back(TrigramEntry{ occurrence.first, 0, postings.size() });
+        }
+        entries.back().postingCount++;
+        postings.push_back(occurrence.second);
+    }
+
+    TrigramIndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, trigramIndexMagic, sizeof(header.magic));
+    header.documentCount = static_cast<uint32_t>(table.size());
+    header.trigramCount = static_cast<uint32_t>(entries.size());
+    header.postingCount = postings.size();
+    header.documentsOffset = sizeof(header);
+    header.trigramsOffset = header.documentsOffset + table.size() * sizeof(TrigramDocument);
+    header.postingsOffset = header.trigramsOffset + entries.size() * sizeof(TrigramEntry);
+    header.stringsOffset = header.postingsOffset + postings.size() * sizeof(uint32_t);
+    header.stringsSize = strings.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(TrigramDocument));
+    out.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(TrigramEntry));
+    out.write(reinterpret_cast<const char *>(postings.data()), postings.size() * sizeof(uint32_t));
+    out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+
+    if(!out) {
+        throw std::runtime_error("failed to write trigram index: " + path);
+    }
+}
+
+TrigramIndex::TrigramIndex(const std::string& path) : file(path) {
+    auto data = file.data();
+    header = reinterpret_cast<const TrigramIndexHeader *>(data);
+    if(file.size() < sizeof(TrigramIndexHeader) ||
+       std::memcmp(header->magic, trigramIndexMagic, sizeof(trigramIndexMagic)) != 0 ||
+       !file.fits(header->documentsOffset, header->documentCount, sizeof(TrigramDocument)) ||
+       !file.fits(header->trigramsOffset, header->trigramCount, sizeof(TrigramEntry)) ||
+       !file.fits(header->postingsOffset, header->postingCount, sizeof(uint32_t)) ||
+       !file.fits(header->stringsOffset, header->stringsSize, 1)) {
+        throw std::runtime_error("not a trigram index: " + path);
+    }
+
+    documents = reinterpret_cast<const TrigramDocument *>(data + header->documentsOffset);
+    trigrams = reinterpret_cast<const TrigramEntry *>(data + header->trigramsOffset);
+    postings = reinterpret_cast<const uint32_t *>(data + header->postingsOffset);
+    strings = data + header->stringsOffset;
+}
+
+void TrigramIndex::check_string(const TrigramString& str) const {
+    if(static_cast<uint64_t>(str.offset) + str.length > header->stringsSize) {
+        throw std::runtime_error("string out of range in trigram index");
+    }
+}
+
+std::string TrigramIndex::string_at(const TrigramString& str) const {
+    check_string(str);
+    return std::string(strings + str.offset, str.length);
+}
+
+const uint32_t *TrigramIndex::postings_for(uint32_t trigram, uint32_t& count) const {
+    auto end = trigrams + header->trigramCount;
+    auto it = std::lower_bound(trigrams, end, trigram, [](const TrigramEntry& entry, uint32_t value) {
+        return entry.trigram < value;
+    });
+
+    if(it == end || it->trigram != trigram) {
+        count = 0;
+        return nullptr;
+    }
+
+    // the list and the documents it names have to be in the file
+    if(it->postingOffset > header->postingCount || it->postingCount > header->postingCount - it->postingOffset) {
+        throw std::runtime_error("postings out of range in trigram index");
+    }
+    auto list = postings + it->postingOffset;
+    for(uint32_t i = 0; i < it->postingCount; i++) {
+        if(list[i] >= header->documentCount) {
+            throw std::runtime_error("document out of range in trigram index");
+        }
+    }
+
+    count = it->postingCount;
+    return list;
+}
+
+bool TrigramIndex::contains(uint32_t document, const std::string& needle) const {
+    auto& row = documents[document];
+    for(auto& str : { row.spelling, row.display, row.qualifiedName }) {
+        check_string(str);
+        auto haystack = strings + str.offset;
+        auto found = std::search(haystack, haystack + str.length, needle.begin(), needle.end(), [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == b;
+        });
+        if(found != haystack + str.length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<uint32_t> TrigramIndex::search(const std::string& query, size_t limit) const {
+    auto needle = fold_case(query);
+    std::vector<uint32_t> results;
+
+    std::vector<uint32_t> queryTrigrams;
+    append_trigrams(needle, queryTrigrams);
+    sort_unique(queryTrigrams);
+
+    if(queryTrigrams.empty()) {
+        // too short to have trigrams, so check every document
+        for(uint32_t document = 0; document < header->documentCount && results.size() < limit; document++) {
+            if(contains(document, needle)) {
+                results.push_back(document);
+            }
+        }
+        return results;
+    }
+
+    // intersect posting lists, rarest first
+    std::vector<std::pair<const uint32_t *, uint32_t>> lists;
+    for(auto trigram : queryTrigrams) {
+        uint32_t count;
+        auto list = postings_for(trigram, count);
+        if(count == 0) {
+            return results;
+        }
+        lists.emplace_back(list, count);
+    }
+    std::sort(lists.begin(), lists.end(), [](const std::pair<const uint32_t *, uint32_t>& a,
+                                             const std::pair<const uint32_t *, uint32_t>& b) {
+        return a.second < b.second;
+    });
+
+    std::vector<uint32_t> candidates(lists[0].first, lists[0].first + lists[0].second);
+    for(size_t l = 1; l < lists.size() && !candidates.empty(); l++) {
+        std::vector<uint32_t> intersection;
+        std::set_intersection(candidates.begin(), candidates.end(),
+                              lists[l].first, lists[l].first + lists[l].second,
+                              std::back_inserter(intersection));
+        candidates.swap(intersection);
+    }
+
+    // trigrams can match out of order, so confirm the substring
+    for(auto document : candidates) {
+        if(results.size() >= limit) {
+            break;
+        }
+        if(contains(document, needle)) {
+            results.push_back(document);
+        }
+    }
+
+    return results;
+}
+
+std::vector<uint32_t> TrigramIndex::fuzzy_search(const std::string& query, size_t limit) const {
+    std::vector<uint32_t> queryTrigrams;
+    append_trigrams(fold_case(query), queryTrigrams);
+    sort_unique(queryTrigrams);
+
+    if(queryTrigrams.empty()) {
+        return search(query, limit);
+    }
+
+    std::unordered_map<uint32_t, uint32_t> scores;
+    for(auto trigram : queryTrigrams) {
+        uint32_t count;
+        auto list = postings_for(trigram, count);
+        for(uint32_t i = 0; i < count; i++) {
+            scores[list[i]]++;
+        }
+    }
+
+    // a single typo touches up to three trigrams; ask for at least half
+    auto threshold = static_cast<uint32_t>((queryTrigrams.size() + 1) / 2);
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranked;
+    for(auto& score : scores) {
+        if(score.second >= threshold) {
+            ranked.emplace_back(score.second, score.first);
+        }
+    }
+
+    // best score first, shorter names before longer ones with the same score
+    std::sort(ranked.begin(), ranked.end(), [this](const std::pair<uint32_t, uint32_t>& a,
+                                                   const std::pair<uint32_t, uint32_t>& b) {
+        if(a.first != b.first) {
+            return a.first > b.first;
+        }
+        auto lengthA = documents[a.second].spelling.length;
+        auto lengthB = documents[b.second].spelling.length;
+        return lengthA != lengthB ? lengthA < lengthB : a.second < b.second;
+    });
+
+    std::vector<uint32_t> results;
+    for(size_t i = 0; i < ranked.size() && results.size() < limit; i++) {
+        results.push_back(ranked[i].second);
+    }
+    return results;
+}
+
+json TrigramIndex::to_json(uint32_t document) const {
+    auto& row = documents[document];
+
+    json j;
+    j["usr"] = string_at(row.usr);
+    j["spelling"] = string_at(row.spelling);
+    j["display"] = string_at(row.display);
+    j["qualified_name"] = string_at(row.qualifiedName);
+    j["location"] = {
+        { "fileName", string_at(row.fileName) },
+        { "line", row.line },
+        { "column", row.column }
+    };
+    return j;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mapped_file.h"
+#include "output.h"
+
+// Trigram index for substring and fuzzy search over declarations.
+//
+// Every declared USR becomes one document (its definition if one was seen)
+// holding its spelling, display name and qualified name. Each distinct
+// case-folded trigram of those names has a sorted posting list of documents.
+//
+// Layout (little-endian):
+//   TrigramIndexHeader
+//   TrigramDocument documents[documentCount]
+//   TrigramEntry trigrams[trigramCount]   (sorted by trigram)
+//   uint32_t postings[postingCount]
+//   char strings[stringsSize]
+
+struct TrigramIndexHeader {
+    char magic[8];
+    uint32_t documentCount;
+    uint32_t trigramCount;
+    uint64_t postingCount;
+    uint64_t documentsOffset;
+    uint64_t trigramsOffset;
+    uint64_t postingsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+struct TrigramString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct TrigramDocument {
+    TrigramString usr;
+    TrigramString spelling;
+    TrigramString display;
+    TrigramString qualifiedName;
+    TrigramString fileName;
+    uint32_t line;
+    uint32_t column;
+};
+
+struct TrigramEntry {
+    uint32_t trigram;
+    uint32_t postingCount;
+    uint64_t postingOffset;
+};
+
+class TrigramIndexBuilder {
+public:
+    void add(const Record& record);
+    // Moves other's documents into this builder; safe to call from several threads.
+    void merge(TrigramIndexBuilder& other);
+
+    void write(const std::string& path) const;
+
+private:
+    struct Document {
+        std::string spelling;
+        std::string display;
+        std::string qualifiedName;
+        std::string fileName;
+        unsigned line;
+        unsigned column;
+        bool isDefinition;
+    };
+
+    void add(const std::string& usr, Document document);
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Document> documents;
+};
+
+class TrigramIndex {
+public:
+    explicit TrigramIndex(const std::string& path);
+
+    // Documents with a name containing query, ignoring case.
+    std::vector<uint32_t> search(const std::string& query, size_t limit) const;
+    // Documents sharing most of query's trigrams with one of their names,
+    // best matches first. Tolerates typos and transpositions.
+    std::vector<uint32_t> fuzzy_search(const std::string& query, size_t limit) const;
+
+    json to_json(uint32_t document) const;
+
+private:
+    const uint32_t *postings_for(uint32_t trigram, uint32_t& count) const;
+    bool contains(uint32_t document, const std::string& needle) const;
+    std::string string_at(const TrigramString& str) const;
+    void check_string(const TrigramString& str) const;
+
+    MappedFile file;
+    const TrigramIndexHeader *header = nullptr;
+    const TrigramDocument *documents = nullptr;
+    const TrigramEntry *trigrams = nullptr;
+    const uint32_t *postings = nullptr;
+    const char *strings = nullptr;
+};
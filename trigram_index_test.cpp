@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include "trigram_index.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char *what) {
+    if(!condition) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// A macro visited right after a declaration, with the record reused between
+// them the way write_cursor does, must not take the declaration's name.
+void macro_after_declaration(const std::string& path) {
+    TrigramIndexBuilder builder;
+
+    Record record;
+    record.usr = "c:@N@outer@F@declared#";
+    record.spelling = "declared";
+    record.display = "declared()";
+    record.qualifiedName = "outer::declared";
+    record.set(RecordFlag_HasQualifiedName, true);
+    record.set(RecordFlag_Definition, true);
+    builder.add(record);
+
+    record.flags = 0;
+    record.usr = "c:macro@SOME_MACRO";
+    record.spelling = "SOME_MACRO";
+    record.display = "SOME_MACRO";
+    builder.add(record);
+
+    builder.write(path);
+    TrigramIndex index(path);
+
+    auto macros = index.search("SOME_MACRO", 10);
+    check(macros.size() == 1, "the macro is found by its spelling");
+    if(macros.size() == 1) {
+        check(index.to_json(macros[0])["qualified_name"] == "", "the macro has no qualified name");
+    }
+
+    auto declarations = index.search("outer::declared", 10);
+    check(declarations.size() == 1, "only the declaration is found by its qualified name");
+}
+
+}
+
+int main() {
+    char path[] = "/tmp/clangtags-trigram-test-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0) {
+        std::perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    macro_after_declaration(path);
+
+    unlink(path);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
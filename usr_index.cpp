@@ -0,0 +1,270 @@
+#include "usr_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include "hash.h"
+
+namespace {
+
+const char usrIndexMagic[8] = { 'C', 'T', 'U', 'S', 'R', 'I', 'X', '1' };
+
+// average number of USRs per bucket; more means a smaller displacement
+// table but a longer search for each bucket's displacement
+const size_t bucketLoad = 4;
+
+// USRs per slot. Below 1 so that the buckets placed last still find free
+// slots quickly; with every slot taken their search grows superlinearly.
+const double slotLoad = 0.9;
+
+// Appends value to strings and returns its offset, which has to fit the
+// 32-bit offsets of the file format along with its end.
+uint32_t append_string(std::string& strings, const std::string& value) {
+    auto offset = strings.size();
+    if(offset + value.size() > UINT32_MAX) {
+        throw std::runtime_error("failed to build USR index: strings exceed 4 GiB");
+    }
+    strings += value;
+    return static_cast<uint32_t>(offset);
+}
+
+}
+
+uint64_t usr_slot(uint64_t hash, uint32_t displacement) {
+    // splitmix64 finalizer over the key hash and the bucket's displacement
+    uint64_t z = hash + (static_cast<uint64_t>(displacement) + 1) * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void UsrIndexBuilder::add(const std::string& usr, Entry entry) {
+    auto it = entries.find(usr);
+    if(it == entries.end()) {
+        entries.emplace(usr, std::move(entry));
+    }
+    else if(entry.isDefinition && !it->second.isDefinition) {
+        it->second = std::move(entry);
+    }
+}
+
+void UsrIndexBuilder::add(const Record& record) {
+    if(record.usr.empty()) {
+        return;
+    }
+
+    Entry entry;
+    entry.fileName = record.fileName;
+    entry.line = record.line;
+    entry.column = record.column;
+    entry.offset = record.offset;
+    entry.kind = record.kind;
+    entry.isDefinition = record.has(RecordFlag_Definition);
+
+    add(record.usr, std::move(entry));
+}
+
+void UsrIndexBuilder::merge(UsrIndexBuilder& other) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(auto& entry : other.entries) {
+        add(entry.first, std::move(entry.second));
+    }
+    other.entries.clear();
+}
+
+void UsrIndexBuilder::write(const std::string& path) const {
+    std::vector<const std::pair<const std::string, Entry> *> keys;
+    keys.reserve(entries.size());
+    for(auto& entry : entries) {
+        keys.push_back(&entry);
+    }
+
+    // UINT32_MAX marks a free slot below
+    if(keys.size() / slotLoad >= UINT32_MAX) {
+        throw std::runtime_error("failed to build USR index: too many USRs");
+    }
+    auto slotCount = static_cast<uint32_t>(keys.size() / slotLoad) + 1;
+    auto bucketCount = static_cast<uint32_t>(std::max<size_t>(1, keys.size() / bucketLoad));
+
+    // keys grouped by bucket in one array, bucket b's being
+    // bucketKeys[bucketStart[b]] up to bucketKeys[bucketStart[b + 1]]
+    std::vector<uint64_t> hashes(keys.size());
+    std::vector<uint32_t> bucketStart(bucketCount + 1, 0);
+    for(size_t i = 0; i < keys.size(); i++) {
+        hashes[i] = fnv1a(keys[i]->first.data(), keys[i]->first.size());
+        bucketStart[hashes[i] % bucketCount + 1]++;
+    }
+    for(uint32_t b = 0; b < bucketCount; b++) {
+        bucketStart[b + 1] += bucketStart[b];
+    }
+    std::vector<uint32_t> bucketKeys(keys.size());
+    std::vector<uint32_t> bucketFill(bucketStart.begin(), bucketStart.end() - 1);
+    for(size_t i = 0; i < keys.size(); i++) {
+        bucketKeys[bucketFill[hashes[i] % bucketCount]++] = static_cast<uint32_t>(i);
+    }
+    auto bucket_size = [&bucketStart](uint32_t b) {
+        return bucketStart[b + 1] - bucketStart[b];
+    };
+
+    // place the largest buckets first, while most slots are still free
+    std::vector<uint32_t> order(bucketCount);
+    for(uint32_t b = 0; b < bucketCount; b++) {
+        order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&bucket_size](uint32_t a, uint32_t b) {
+        return bucket_size(a) > bucket_size(b);
+    });
+
+    std::vector<uint32_t> displacements(bucketCount, 0);
+    std::vector<uint32_t> slotKey(slotCount, UINT32_MAX);
+    std::vector<uint32_t> candidate;
+
+    for(auto b : order) {
+        auto begin = bucketKeys.begin() + bucketStart[b];
+        auto end = bucketKeys.begin() + bucketStart[b + 1];
+        if(begin == end) {
+            break;
+        }
+
+        for(uint32_t d = 0;; d++) {
+            if(d == UINT32_MAX) {
+                throw std::runtime_error("failed to build USR index: no displacement found");
+            }
+
+            candidate.clear();
+            bool placed = true;
+            for(auto key = begin; key != end; ++key) {
+                auto slot = static_cast<uint32_t>(usr_slot(hashes[*key], d) % slotCount);
+                if(slotKey[slot] != UINT32_MAX || std::find(candidate.begin(), candidate.end(), slot) != candidate.end()) {
+                    placed = false;
+                    break;
+                }
+                candidate.push_back(slot);
+            }
+
+            if(placed) {
+                displacements[b] = d;
+                for(size_t k = 0; k < candidate.size(); k++) {
+                    slotKey[candidate[k]] = begin[k];
+                }
+                break;
+            }
+        }
+    }
+
+    // file names repeat a lot, so they are stored once each
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> fileOffsets;
+    std::vector<UsrIndexSlot> slots(slotCount);
+
+    for(uint32_t s = 0; s < slotCount; s++) {
+        auto& slot = slots[s];
+        if(slotKey[s] == UINT32_MAX) {
+            // free: the empty USR is never indexed, so this matches nothing
+            std::memset(&slot, 0, sizeof(slot));
+            continue;
+        }
+
+        auto& key = *keys[slotKey[s]];
+        auto& entry = key.second;
+
+        slot.usrOffset = append_string(strings, key.first);
+        slot.usrLength = static_cast<uint32_t>(key.first.size());
+
+        auto file = fileOffsets.find(entry.fileName);
+        if(file == fileOffsets.end()) {
+            file = fileOffsets.emplace(entry.fileName, append_string(strings, entry.fileName)).first;
+        }
+        slot.fileOffset = file->second;
+        slot.fileLength = static_cast<uint32_t>(entry.fileName.size());
+
+        slot.line = entry.line;
+        slot.column = entry.column;
+        slot.offset = entry.offset;
+        slot.kind = static_cast<uint16_t>(entry.kind);
+        slot.isDefinition = entry.isDefinition ? 1 : 0;
+    }
+
+    UsrIndexHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, usrIndexMagic, sizeof(header.magic));
+    header.slotCount = slotCount;
+    header.bucketCount = bucketCount;
+    header.displacementsOffset = sizeof(header);
+    header.slotsOffset = header.displacementsOffset + bucketCount * sizeof(uint32_t);
+    // keep slots 8-byte aligned for readers that map the file
+    header.slotsOffset = (header.slotsOffset + 7) & ~static_cast<uint64_t>(7);
+    header.stringsOffset = header.slotsOffset + slotCount * sizeof(UsrIndexSlot);
+    header.stringsSize = strings.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(displacements.data()), displacements.size() * sizeof(uint32_t));
+    static const char padding[8] = {};
+    out.write(padding, static_cast<std::streamsize>(header.slotsOffset - header.displacementsOffset - bucketCount * sizeof(uint32_t)));
+    out.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(UsrIndexSlot));
+    out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+
+    if(!out) {
+        throw std::runtime_error("failed to write USR index: " + path);
+    }
+}
+
+UsrIndex::UsrIndex(const std::string& path) : file(path) {
+    auto data = file.data();
+    header = reinterpret_cast<const UsrIndexHeader *>(data);
+    if(file.size() < sizeof(UsrIndexHeader) ||
+       std::memcmp(header->magic, usrIndexMagic, sizeof(usrIndexMagic)) != 0 ||
+       !file.fits(header->displacementsOffset, header->bucketCount, sizeof(uint32_t)) ||
+       !file.fits(header->slotsOffset, header->slotCount, sizeof(UsrIndexSlot)) ||
+       !file.fits(header->stringsOffset, header->stringsSize, 1) ||
+       (header->slotCount != 0 && header->bucketCount == 0)) {
+        throw std::runtime_error("not a USR index: " + path);
+    }
+
+    displacements = reinterpret_cast<const uint32_t *>(data + header->displacementsOffset);
+    slots = reinterpret_cast<const UsrIndexSlot *>(data + header->slotsOffset);
+    strings = data + header->stringsOffset;
+}
+
+const UsrIndexSlot *UsrIndex::find(const std::string& usr) const {
+    if(header->slotCount == 0 || usr.empty()) {
+        return nullptr;
+    }
+
+    auto hash = fnv1a(usr.data(), usr.size());
+    auto displacement = displacements[hash % header->bucketCount];
+    auto& slot = slots[usr_slot(hash, displacement) % header->slotCount];
+
+    if(slot.usrLength != usr.size() || !in_strings(slot.usrOffset, slot.usrLength) ||
+       std::memcmp(strings + slot.usrOffset, usr.data(), usr.size()) != 0) {
+        return nullptr;
+    }
+    return &slot;
+}
+
+bool UsrIndex::in_strings(uint32_t offset, uint32_t length) const {
+    return static_cast<uint64_t>(offset) + length <= header->stringsSize;
+}
+
+std::string UsrIndex::string_at(uint32_t offset, uint32_t length) const {
+    if(!in_strings(offset, length)) {
+        throw std::runtime_error("string out of range in USR index");
+    }
+    return std::string(strings + offset, length);
+}
+
+json UsrIndex::to_json(const UsrIndexSlot& slot) const {
+    json j;
+    j["usr"] = string_at(slot.usrOffset, slot.usrLength);
+    j["location"] = {
+        { "fileName", string_at(slot.fileOffset, slot.fileLength) },
+        { "line", slot.line },
+        { "column", slot.column },
+        { "offset", slot.offset }
+    };
+    j["kind"] = slot.kind;
+    j["is_definition"] = slot.isDefinition != 0;
+    return j;
+}
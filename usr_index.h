@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mapped_file.h"
+#include "output.h"
+
+// Binary USR index, resolved in O(1) straight out of an mmap'd file.
+//
+// Layout (little-endian):
+//   UsrIndexHeader
+//   uint32_t displacements[bucketCount]
+//   UsrIndexSlot slots[slotCount]
+//   char strings[stringsSize]
+//
+// Slots are placed with a perfect hash (hash and displace): a USR's bucket is
+// fnv1a(usr) % bucketCount and its slot is
+// usr_slot(fnv1a(usr), displacements[bucket]) % slotCount. A few slots are
+// left free, with an empty USR. The slot's USR must still be compared, since
+// any string hashes to some slot.
+
+struct UsrIndexHeader {
+    char magic[8];
+    uint32_t slotCount;
+    uint32_t bucketCount;
+    uint64_t displacementsOffset;
+    uint64_t slotsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+// Where a USR is defined, or declared if no definition was seen.
+struct UsrIndexSlot {
+    uint32_t usrOffset;
+    uint32_t usrLength;
+    uint32_t fileOffset;
+    uint32_t fileLength;
+    uint32_t line;
+    uint32_t column;
+    uint32_t offset;
+    uint16_t kind;
+    uint16_t isDefinition;
+};
+
+static_assert(sizeof(UsrIndexSlot) == 32, "UsrIndexSlot is part of the file format");
+
+uint64_t usr_slot(uint64_t hash, uint32_t displacement);
+
+class UsrIndexBuilder {
+public:
+    void add(const Record& record);
+    // Moves other's entries into this builder; safe to call from several threads.
+    void merge(UsrIndexBuilder& other);
+
+    void write(const std::string& path) const;
+
+private:
+    struct Entry {
+        std::string fileName;
+        unsigned line;
+        unsigned column;
+        unsigned offset;
+        unsigned kind;
+        bool isDefinition;
+    };
+
+    void add(const std::string& usr, Entry entry);
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+// Read-only view of an index file, mapped into memory.
+class UsrIndex {
+public:
+    explicit UsrIndex(const std::string& path);
+
+    // nullptr if usr is not in the index
+    const UsrIndexSlot *find(const std::string& usr) const;
+    std::string string_at(uint32_t offset, uint32_t length) const;
+
+    json to_json(const UsrIndexSlot& slot) const;
+
+private:
+    bool in_strings(uint32_t offset, uint32_t length) const;
+
+    MappedFile file;
+    const UsrIndexHeader *header = nullptr;
+    const uint32_t *displacements = nullptr;
+    const UsrIndexSlot *slots = nullptr;
+    const char *strings = nullptr;
+};
@@ -0,0 +1,289 @@
+#include "xref_graph.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <tuple>
+
+namespace {
+
+const char xrefGraphMagic[8] = { 'C', 'T', 'X', 'R', 'E', 'F', 'G', '1' };
+
+// occurrences a builder collects before it first compacts them
+const size_t minCompactSize = 1 << 16;
+
+// Appends value to strings, whose offsets are 32 bits in the file.
+XrefString append_string(std::string& strings, const std::string& value) {
+    if(strings.size() + value.size() > UINT32_MAX) {
+        throw std::runtime_error("failed to build cross-reference graph: strings exceed 4 GiB");
+    }
+    XrefString result{ static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(value.size()) };
+    strings += value;
+    return result;
+}
+
+// Ranks of the ids of values in sorted order.
+std::vector<uint32_t> sorted_ranks(const std::vector<std::string>& values) {
+    std::vector<uint32_t> order(values.size());
+    for(uint32_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&values](uint32_t a, uint32_t b) {
+        return values[a] < values[b];
+    });
+
+    std::vector<uint32_t> ranks(values.size());
+    for(uint32_t rank = 0; rank < order.size(); rank++) {
+        ranks[order[rank]] = rank;
+    }
+    return ranks;
+}
+
+}
+
+uint32_t XrefGraphBuilder::intern(const std::string& value, std::unordered_map<std::string, uint32_t>& ids,
+                                  std::vector<std::string>& values) {
+    auto it = ids.find(value);
+    if(it != ids.end()) {
+        return it->second;
+    }
+
+    auto id = static_cast<uint32_t>(values.size());
+    values.push_back(value);
+    ids.emplace(value, id);
+    return id;
+}
+
+void XrefGraphBuilder::add(const Record& record) {
+    if(!record.has(RecordFlag_HasReferenced) || record.referencedUSR.empty() || !record.has(RecordFlag_HasFileName)) {
+        return;
+    }
+
+    Occurrence occurrence;
+    occurrence.usr = intern(record.referencedUSR, usrIds, usrs);
+    occurrence.fileName = intern(record.fileName, fileIds, files);
+    occurrence.line = record.line;
+    occurrence.column = record.column;
+    occurrence.offset = record.offset;
+    occurrence.kind = record.kind;
+
+    // a declaration's cursor references the declaration itself
+    occurrence.flags = 0;
+    if(record.usr == record.referencedUSR) {
+        occurrence.flags |= XrefEdge_Declaration;
+        if(record.has(RecordFlag_Definition)) {
+            occurrence.flags |= XrefEdge_Definition;
+        }
+    }
+
+    occurrences.push_back(occurrence);
+    compact_if_grown();
+}
+
+void XrefGraphBuilder::compact() {
+    // headers are seen by many TUs, so most of their occurrences come in
+    // several times; sorting brings the copies together
+    auto key = [](const Occurrence& o) {
+        return std::make_tuple(o.usr, o.fileName, o.offset, o.kind, o.flags);
+    };
+    std::sort(occurrences.begin(), occurrences.end(), [&key](const Occurrence& a, const Occurrence& b) {
+        return key(a) < key(b);
+    });
+    occurrences.erase(std::unique(occurrences.begin(), occurrences.end(), [&key](const Occurrence& a, const Occurrence& b) {
+        return key(a) == key(b);
+    }), occurrences.end());
+    compactedSize = occurrences.size();
+}
+
+void XrefGraphBuilder::compact_if_grown() {
+    if(occurrences.size() >= std::max(minCompactSize, 2 * compactedSize)) {
+        compact();
+    }
+}
+
+void XrefGraphBuilder::merge(XrefGraphBuilder& other) {
+    other.compact();
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<uint32_t> usrMap;
+    usrMap.reserve(other.usrs.size());
+    for(auto& usr : other.usrs) {
+        usrMap.push_back(intern(usr, usrIds, usrs));
+    }
+    std::vector<uint32_t> fileMap;
+    fileMap.reserve(other.files.size());
+    for(auto& file : other.files) {
+        fileMap.push_back(intern(file, fileIds, files));
+    }
+
+    occurrences.reserve(occurrences.size() + other.occurrences.size());
+    for(auto occurrence : other.occurrences) {
+        occurrence.usr = usrMap[occurrence.usr];
+        occurrence.fileName = fileMap[occurrence.fileName];
+        occurrences.push_back(occurrence);
+    }
+    compact_if_grown();
+
+    other.usrIds.clear();
+    other.usrs.clear();
+    other.fileIds.clear();
+    other.files.clear();
+    other.occurrences.clear();
+    other.compactedSize = 0;
+}
+
+void XrefGraphBuilder::write(const std::string& path) const {
+    auto usrRanks = sorted_ranks(usrs);
+    auto fileRanks = sorted_ranks(files);
+
+    // the copies merged from different workers since the last compact()
+    // are still there; sorting brings them together
+    auto key = [&](const Occurrence& o) {
+        return std::make_tuple(usrRanks[o.usr], fileRanks[o.fileName], o.offset, o.kind, o.flags);
+    };
+    std::vector<size_t> order(occurrences.size());
+    for(size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return key(occurrences[a]) < key(occurrences[b]);
+    });
+    order.erase(std::unique(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return key(occurrences[a]) == key(occurrences[b]);
+    }), order.end());
+
+    std::string strings;
+
+    std::vector<XrefString> nodes(usrs.size());
+    std::vector<uint32_t> nodeUsrs(usrs.size());
+    for(uint32_t id = 0; id < usrs.size(); id++) {
+        nodeUsrs[usrRanks[id]] = id;
+    }
+    for(size_t node = 0; node < nodes.size(); node++) {
+        nodes[node] = append_string(strings, usrs[nodeUsrs[node]]);
+    }
+
+    // in sorted order too, so that the file does not depend on which
+    // worker merged first
+    std::vector<uint32_t> sortedFiles(files.size());
+    for(uint32_t id = 0; id < files.size(); id++) {
+        sortedFiles[fileRanks[id]] = id;
+    }
+    std::vector<XrefString> fileStrings(files.size());
+    for(auto id : sortedFiles) {
+        fileStrings[id] = append_string(strings, files[id]);
+    }
+
+    std::vector<uint64_t> offsets(nodes.size() + 1, 0);
+    std::vector<XrefEdge> edges;
+    edges.reserve(order.size());
+    for(auto i : order) {
+        auto& occurrence = occurrences[i];
+        offsets[usrRanks[occurrence.usr] + 1]++;
+
+        XrefEdge edge;
+        edge.fileName = fileStrings[occurrence.fileName];
+        edge.line = occurrence.line;
+        edge.column = occurrence.column;
+        edge.offset = occurrence.offset;
+        edge.kind = static_cast<uint16_t>(occurrence.kind);
+        edge.flags = occurrence.flags;
+        edges.push_back(edge);
+    }
+    for(size_t node = 0; node < nodes.size(); node++) {
+        offsets[node + 1] += offsets[node];
+    }
+
+    XrefGraphHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, xrefGraphMagic, sizeof(header.magic));
+    header.nodeCount = static_cast<uint32_t>(nodes.size());
+    header.edgeCount = edges.size();
+    header.nodesOffset = sizeof(header);
+    // nodes are 8 bytes each, so everything after them stays 8-byte aligned
+    header.offsetsOffset = header.nodesOffset + nodes.size() * sizeof(XrefString);
+    header.edgesOffset = header.offsetsOffset + offsets.size() * sizeof(uint64_t);
+    header.stringsOffset = header.edgesOffset + edges.size() * sizeof(XrefEdge);
+    header.stringsSize = strings.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(XrefString));
+    out.write(reinterpret_cast<const char *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char *>(edges.data()), edges.size() * sizeof(XrefEdge));
+    out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+
+    if(!out) {
+        throw std::runtime_error("failed to write cross-reference graph: " + path);
+    }
+}
+
+XrefGraph::XrefGraph(const std::string& path) : file(path) {
+    auto data = file.data();
+    header = reinterpret_cast<const XrefGraphHeader *>(data);
+    if(file.size() < sizeof(XrefGraphHeader) ||
+       std::memcmp(header->magic, xrefGraphMagic, sizeof(xrefGraphMagic)) != 0 ||
+       !file.fits(header->nodesOffset, header->nodeCount, sizeof(XrefString)) ||
+       !file.fits(header->offsetsOffset, static_cast<uint64_t>(header->nodeCount) + 1, sizeof(uint64_t)) ||
+       !file.fits(header->edgesOffset, header->edgeCount, sizeof(XrefEdge)) ||
+       !file.fits(header->stringsOffset, header->stringsSize, 1)) {
+        throw std::runtime_error("not a cross-reference graph: " + path);
+    }
+
+    nodes = reinterpret_cast<const XrefString *>(data + header->nodesOffset);
+    offsets = reinterpret_cast<const uint64_t *>(data + header->offsetsOffset);
+    edges = reinterpret_cast<const XrefEdge *>(data + header->edgesOffset);
+    strings = data + header->stringsOffset;
+
+    // the offsets of single nodes are checked as they are looked up
+    if(offsets[0] != 0 || offsets[header->nodeCount] != header->edgeCount) {
+        throw std::runtime_error("not a cross-reference graph: " + path);
+    }
+}
+
+std::pair<const XrefEdge *, const XrefEdge *> XrefGraph::find(const std::string& usr) const {
+    auto end = nodes + header->nodeCount;
+    auto node = std::lower_bound(nodes, end, usr, [this](const XrefString& node, const std::string& usr) {
+        check_string(node);
+        auto length = std::min<size_t>(node.length, usr.size());
+        auto order = std::memcmp(strings + node.offset, usr.data(), length);
+        return order < 0 || (order == 0 && node.length < usr.size());
+    });
+
+    if(node == end || node->length != usr.size() || std::memcmp(strings + node->offset, usr.data(), usr.size()) != 0) {
+        return std::make_pair(nullptr, nullptr);
+    }
+
+    auto index = node - nodes;
+    if(offsets[index] > offsets[index + 1] || offsets[index + 1] > header->edgeCount) {
+        throw std::runtime_error("edges out of range in cross-reference graph");
+    }
+    return std::make_pair(edges + offsets[index], edges + offsets[index + 1]);
+}
+
+void XrefGraph::check_string(const XrefString& str) const {
+    if(static_cast<uint64_t>(str.offset) + str.length > header->stringsSize) {
+        throw std::runtime_error("string out of range in cross-reference graph");
+    }
+}
+
+std::string XrefGraph::string_at(const XrefString& str) const {
+    check_string(str);
+    return std::string(strings + str.offset, str.length);
+}
+
+json XrefGraph::to_json(const XrefEdge& edge) const {
+    json j;
+    j["location"] = {
+        { "fileName", string_at(edge.fileName) },
+        { "line", edge.line },
+        { "column", edge.column },
+        { "offset", edge.offset }
+    };
+    j["kind"] = edge.kind;
+    j["is_declaration"] = (edge.flags & XrefEdge_Declaration) != 0;
+    j["is_definition"] = (edge.flags & XrefEdge_Definition) != 0;
+    return j;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mapped_file.h"
+#include "output.h"
+
+// Cross-reference graph in compressed sparse row form.
+//
+// Every USR that is referenced (declarations count as references to
+// themselves) is a node. The edges of node n are the occurrences
+// referring to it, edges[offsets[n]] up to edges[offsets[n + 1]], ordered
+// by file and offset. Finding all references of a USR is a binary search
+// over the nodes and one contiguous read of its edges.
+//
+// Layout (little-endian):
+//   XrefGraphHeader
+//   XrefString nodes[nodeCount]          (USRs, sorted)
+//   uint64_t offsets[nodeCount + 1]
+//   XrefEdge edges[edgeCount]
+//   char strings[stringsSize]
+
+struct XrefGraphHeader {
+    char magic[8];
+    uint32_t nodeCount;
+    uint32_t reserved;
+    uint64_t edgeCount;
+    uint64_t nodesOffset;
+    uint64_t offsetsOffset;
+    uint64_t edgesOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+};
+
+struct XrefString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+enum XrefEdgeFlags : uint16_t {
+    // the occurrence declares the node rather than referring to it
+    XrefEdge_Declaration = 1 << 0,
+    XrefEdge_Definition = 1 << 1,
+};
+
+// One occurrence of a node.
+struct XrefEdge {
+    XrefString fileName;
+    uint32_t line;
+    uint32_t column;
+    uint32_t offset;
+    // CXCursorKind of the referring cursor
+    uint16_t kind;
+    uint16_t flags;
+};
+
+static_assert(sizeof(XrefString) == 8, "XrefString is part of the file format");
+static_assert(sizeof(XrefEdge) == 24, "XrefEdge is part of the file format");
+
+class XrefGraphBuilder {
+public:
+    void add(const Record& record);
+    // Moves other's occurrences into this builder; safe to call from several threads.
+    void merge(XrefGraphBuilder& other);
+
+    void write(const std::string& path) const;
+
+private:
+    struct Occurrence {
+        uint32_t usr;
+        uint32_t fileName;
+        unsigned line;
+        unsigned column;
+        unsigned offset;
+        unsigned kind;
+        uint16_t flags;
+    };
+
+    uint32_t intern(const std::string& value, std::unordered_map<std::string, uint32_t>& ids,
+                    std::vector<std::string>& values);
+    // Drops repeated occurrences; add() and merge() call it whenever
+    // occurrences has doubled since the last time.
+    void compact();
+    void compact_if_grown();
+
+    std::mutex mutex;
+    // USRs and file names by id, as occurrences refer to them
+    std::unordered_map<std::string, uint32_t> usrIds;
+    std::vector<std::string> usrs;
+    std::unordered_map<std::string, uint32_t> fileIds;
+    std::vector<std::string> files;
+    std::vector<Occurrence> occurrences;
+    // occurrences.size() after the last compact()
+    size_t compactedSize = 0;
+};
+
+// Read-only view of a graph file, mapped into memory.
+class XrefGraph {
+public:
+    explicit XrefGraph(const std::string& path);
+
+    // The edges of usr as [begin, end), both null if usr is not a node.
+    std::pair<const XrefEdge *, const XrefEdge *> find(const std::string& usr) const;
+    std::string string_at(const XrefString& str) const;
+
+    json to_json(const XrefEdge& edge) const;
+
+private:
+    void check_string(const XrefString& str) const;
+
+    MappedFile file;
+    const XrefGraphHeader *header = nullptr;
+    const XrefString *nodes = nullptr;
+    const uint64_t *offsets = nullptr;
+    const XrefEdge *edges = nullptr;
+    const char *strings = nullptr;
+};